@@ -0,0 +1,326 @@
+/*
+ * LiFePO4wered access native Python extension module
+ * Copyright (C) 2020 Patrick Van Oosterwijck
+ * Released under the GPL v2
+ */
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#include <pythread.h>
+#include <time.h>
+#include "lifepo4wered-data.h"
+#include "lifepo4wered-access.h"
+
+
+/* Lock serializing bus access between Python threads, since the
+ * library keeps global state.  It is taken with the GIL released, so
+ * threads not using the bus keep running during I/O. */
+
+static PyThread_type_lock bus_lock;
+
+/* Number of open sessions sharing the library's persistent session */
+
+static int session_count;
+
+/* Session object */
+
+typedef struct {
+  PyObject_HEAD
+  bool      open;
+} SessionObject;
+
+/* Sample stream iterator object */
+
+typedef struct {
+  PyObject_HEAD
+  SessionObject   *session;
+  struct timespec next;       /* Time the next sample is due */
+  long            period_ns;  /* Sample period */
+  Py_ssize_t      remaining;  /* Samples left, -1 for unlimited */
+} StreamObject;
+
+static PyTypeObject SessionType;
+static PyTypeObject StreamType;
+
+
+/* Add nanoseconds to a timespec */
+
+static void timespec_add(struct timespec *ts, long ns) {
+  ts->tv_nsec += ns;
+  while (ts->tv_nsec >= 1000000000) {
+    ts->tv_nsec -= 1000000000;
+    ts->tv_sec++;
+  }
+}
+
+/* Determine if timespec a is before timespec b */
+
+static bool timespec_before(const struct timespec *a,
+                            const struct timespec *b) {
+  return a->tv_sec < b->tv_sec ||
+          (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+/* Check that the session is open, raising an exception if not */
+
+static bool check_open(SessionObject *self) {
+  if (!self->open) {
+    PyErr_SetString(PyExc_ValueError, "session is closed");
+  }
+  return self->open;
+}
+
+/* Take a snapshot with the GIL released and convert it to a dict */
+
+static PyObject *take_snapshot(void) {
+  int32_t values[LFP_VAR_COUNT];
+  Py_BEGIN_ALLOW_THREADS
+  PyThread_acquire_lock(bus_lock, WAIT_LOCK);
+  read_lifepo4wered_snapshot(values);
+  PyThread_release_lock(bus_lock);
+  Py_END_ALLOW_THREADS
+  PyObject *dict = PyDict_New();
+  if (!dict) return NULL;
+  for (int var = 0; var < LFP_VAR_COUNT; var++) {
+    if (values[var] == -1) continue;
+    PyObject *value = PyLong_FromLong(values[var]);
+    if (!value || PyDict_SetItemString(dict, lifepo4wered_var_name[var],
+                                       value) < 0) {
+      Py_XDECREF(value);
+      Py_DECREF(dict);
+      return NULL;
+    }
+    Py_DECREF(value);
+  }
+  return dict;
+}
+
+/* Session methods */
+
+static PyObject *Session_new(PyTypeObject *type, PyObject *args,
+                             PyObject *kwds) {
+  SessionObject *self = (SessionObject *)type->tp_alloc(type, 0);
+  if (!self) return NULL;
+  bool ok;
+  int err;
+  Py_BEGIN_ALLOW_THREADS
+  PyThread_acquire_lock(bus_lock, WAIT_LOCK);
+  ok = session_count > 0 || open_lifepo4wered_session();
+  err = errno;
+  if (ok) session_count++;
+  PyThread_release_lock(bus_lock);
+  Py_END_ALLOW_THREADS
+  if (!ok) {
+    Py_DECREF(self);
+    errno = err;
+    return PyErr_SetFromErrno(PyExc_OSError);
+  }
+  self->open = true;
+  return (PyObject *)self;
+}
+
+static PyObject *Session_close(SessionObject *self, PyObject *unused) {
+  if (self->open) {
+    self->open = false;
+    Py_BEGIN_ALLOW_THREADS
+    PyThread_acquire_lock(bus_lock, WAIT_LOCK);
+    if (--session_count == 0) close_lifepo4wered_session();
+    PyThread_release_lock(bus_lock);
+    Py_END_ALLOW_THREADS
+  }
+  Py_RETURN_NONE;
+}
+
+static void Session_dealloc(SessionObject *self) {
+  Py_XDECREF(Session_close(self, NULL));
+  Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static PyObject *Session_enter(SessionObject *self, PyObject *unused) {
+  if (!check_open(self)) return NULL;
+  Py_INCREF(self);
+  return (PyObject *)self;
+}
+
+static PyObject *Session_exit(SessionObject *self, PyObject *args) {
+  return Session_close(self, NULL);
+}
+
+static PyObject *Session_access(SessionObject *self, PyObject *args) {
+  int var, access_mask;
+  bool result;
+  if (!PyArg_ParseTuple(args, "ii", &var, &access_mask)) return NULL;
+  if (!check_open(self)) return NULL;
+  Py_BEGIN_ALLOW_THREADS
+  PyThread_acquire_lock(bus_lock, WAIT_LOCK);
+  result = access_lifepo4wered(var, access_mask);
+  PyThread_release_lock(bus_lock);
+  Py_END_ALLOW_THREADS
+  return PyBool_FromLong(result);
+}
+
+static PyObject *Session_read(SessionObject *self, PyObject *args) {
+  int var;
+  int32_t value;
+  if (!PyArg_ParseTuple(args, "i", &var)) return NULL;
+  if (!check_open(self)) return NULL;
+  Py_BEGIN_ALLOW_THREADS
+  PyThread_acquire_lock(bus_lock, WAIT_LOCK);
+  value = read_lifepo4wered(var);
+  PyThread_release_lock(bus_lock);
+  Py_END_ALLOW_THREADS
+  return PyLong_FromLong(value);
+}
+
+static PyObject *Session_write(SessionObject *self, PyObject *args) {
+  int var;
+  int32_t value;
+  if (!PyArg_ParseTuple(args, "ii", &var, &value)) return NULL;
+  if (!check_open(self)) return NULL;
+  Py_BEGIN_ALLOW_THREADS
+  PyThread_acquire_lock(bus_lock, WAIT_LOCK);
+  value = write_lifepo4wered(var, value);
+  PyThread_release_lock(bus_lock);
+  Py_END_ALLOW_THREADS
+  return PyLong_FromLong(value);
+}
+
+static PyObject *Session_snapshot(SessionObject *self, PyObject *unused) {
+  if (!check_open(self)) return NULL;
+  return take_snapshot();
+}
+
+static PyObject *Session_stream(SessionObject *self, PyObject *args,
+                                PyObject *kwds) {
+  static char *kwlist[] = { "rate", "count", NULL };
+  double rate = 1.0;
+  Py_ssize_t count = -1;
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "|dn", kwlist,
+                                   &rate, &count))
+    return NULL;
+  if (!check_open(self)) return NULL;
+  if (rate <= 0 || rate > 1000) {
+    PyErr_SetString(PyExc_ValueError, "rate must be between 0 and 1000 Hz");
+    return NULL;
+  }
+  StreamObject *stream = PyObject_New(StreamObject, &StreamType);
+  if (!stream) return NULL;
+  Py_INCREF(self);
+  stream->session = self;
+  stream->period_ns = (long)(1e9 / rate);
+  stream->remaining = count;
+  clock_gettime(CLOCK_MONOTONIC, &stream->next);
+  return (PyObject *)stream;
+}
+
+static PyMethodDef Session_methods[] = {
+  { "access", (PyCFunction)Session_access, METH_VARARGS,
+    "access(var, access_mask) -> bool\n\n"
+    "Determine if the variable can be accessed in the specified manner." },
+  { "read", (PyCFunction)Session_read, METH_VARARGS,
+    "read(var) -> int\n\nRead a variable." },
+  { "write", (PyCFunction)Session_write, METH_VARARGS,
+    "write(var, value) -> int\n\nWrite a variable, returns the read back "
+    "value." },
+  { "snapshot", (PyCFunction)Session_snapshot, METH_NOARGS,
+    "snapshot() -> dict\n\nRead all readable variables in one batched "
+    "bus pass.\nValues that could not be read reliably are -2." },
+  { "stream", (PyCFunction)Session_stream, METH_VARARGS|METH_KEYWORDS,
+    "stream(rate=1.0, count=-1) -> iterator\n\n"
+    "Iterate over (timestamp, snapshot) samples taken at a fixed rate (Hz),\n"
+    "for count samples or forever if count is negative." },
+  { "close", (PyCFunction)Session_close, METH_NOARGS,
+    "close()\n\nClose the session." },
+  { "__enter__", (PyCFunction)Session_enter, METH_NOARGS, NULL },
+  { "__exit__", (PyCFunction)Session_exit, METH_VARARGS, NULL },
+  { NULL }
+};
+
+static PyTypeObject SessionType = {
+  PyVarObject_HEAD_INIT(NULL, 0)
+  .tp_name = "_lifepo4wered.Session",
+  .tp_doc = "Persistent LiFePO4wered device session",
+  .tp_basicsize = sizeof(SessionObject),
+  .tp_flags = Py_TPFLAGS_DEFAULT,
+  .tp_new = Session_new,
+  .tp_dealloc = (destructor)Session_dealloc,
+  .tp_methods = Session_methods,
+};
+
+/* Stream methods */
+
+static void Stream_dealloc(StreamObject *self) {
+  Py_XDECREF(self->session);
+  PyObject_Del(self);
+}
+
+static PyObject *Stream_next(StreamObject *self) {
+  if (self->remaining == 0 || !check_open(self->session)) return NULL;
+  /* Wait until the sample is due, without holding the GIL */
+  struct timespec now;
+  int err;
+  do {
+    Py_BEGIN_ALLOW_THREADS
+    err = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &self->next, NULL);
+    Py_END_ALLOW_THREADS
+    if (PyErr_CheckSignals() < 0) return NULL;
+  } while (err == EINTR);
+  /* Schedule the next sample, skipping missed ones if we fell behind */
+  timespec_add(&self->next, self->period_ns);
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  if (timespec_before(&self->next, &now)) {
+    self->next = now;
+    timespec_add(&self->next, self->period_ns);
+  }
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  PyObject *snapshot = take_snapshot();
+  if (!snapshot) return NULL;
+  if (self->remaining > 0) self->remaining--;
+  return Py_BuildValue("(dN)", ts.tv_sec + ts.tv_nsec / 1e9, snapshot);
+}
+
+static PyTypeObject StreamType = {
+  PyVarObject_HEAD_INIT(NULL, 0)
+  .tp_name = "_lifepo4wered.Stream",
+  .tp_doc = "Fixed rate LiFePO4wered sample stream",
+  .tp_basicsize = sizeof(StreamObject),
+  .tp_flags = Py_TPFLAGS_DEFAULT,
+  .tp_dealloc = (destructor)Stream_dealloc,
+  .tp_iter = PyObject_SelfIter,
+  .tp_iternext = (iternextfunc)Stream_next,
+};
+
+/* Module definition */
+
+static struct PyModuleDef lifepo4wered_module = {
+  PyModuleDef_HEAD_INIT,
+  .m_name = "_lifepo4wered",
+  .m_doc = "Native LiFePO4wered device access",
+  .m_size = -1,
+};
+
+PyMODINIT_FUNC PyInit__lifepo4wered(void) {
+  if (PyType_Ready(&SessionType) < 0 || PyType_Ready(&StreamType) < 0)
+    return NULL;
+  bus_lock = PyThread_allocate_lock();
+  if (!bus_lock) return PyErr_NoMemory();
+  PyObject *m = PyModule_Create(&lifepo4wered_module);
+  if (!m) return NULL;
+  Py_INCREF(&SessionType);
+  if (PyModule_AddObject(m, "Session", (PyObject *)&SessionType) < 0) {
+    Py_DECREF(&SessionType);
+    Py_DECREF(m);
+    return NULL;
+  }
+  /* Variable definitions */
+  for (int var = 0; var < LFP_VAR_COUNT; var++) {
+    if (PyModule_AddIntConstant(m, lifepo4wered_var_name[var], var) < 0) {
+      Py_DECREF(m);
+      return NULL;
+    }
+  }
+  PyModule_AddIntConstant(m, "ACCESS_READ", ACCESS_READ);
+  PyModule_AddIntConstant(m, "ACCESS_WRITE", ACCESS_WRITE);
+  return m;
+}
@@ -2,101 +2,197 @@
 // Copyright (c) 2018 Patrick Van Oosterwijck
 
 var ffi = require('ffi')
+var os = require('os')
+
+// Variable definitions and constants, generated from the register map
+
+var regs = require('./lifepo4wered-regs')
 
 // Load access functions from shared object
 
 var lib = ffi.Library('/usr/local/lib/liblifepo4wered.so', {
   'access_lifepo4wered': [ 'int', [ 'int', 'int' ] ],
   'read_lifepo4wered': [ 'int', [ 'int' ] ],
-  'write_lifepo4wered': [ 'int', [ 'int', 'int' ] ]
+  'read_lifepo4wered_vars': [ 'int', [ 'uint8', 'pointer', 'pointer' ] ],
+  'read_lifepo4wered_snapshot': [ 'int', [ 'pointer' ] ],
+  'write_lifepo4wered': [ 'int', [ 'int', 'int' ] ],
+  'open_lifepo4wered_session': [ 'bool', [ ] ]
 });
 
+// Asynchronous access
+//
+// Requests are queued and served one at a time on the libuv thread pool
+// (through ffi's async calls), so bus I/O never blocks the event loop.
+// Reads that queue up while the bus is busy are served together, from a
+// single snapshot read if one was requested, otherwise by validating the
+// variables read together from one register block.
+
+var queue = [];
+var busy = false;
+var sessionOpen = false;
+
+// Read 32-bit integers from a buffer in native byte order
+
+function readInts(buf, count) {
+  var values = [];
+  for (var i = 0; i < count; i++) {
+    values.push(buf['readInt32' + os.endianness()](4 * i));
+  }
+  return values;
+}
+
+// Serve a batch of requests on the thread pool
+
+function serve(batch, done) {
+  var first = batch[0];
+  if (first.op === 'write') {
+    lib.write_lifepo4wered.async(first.v, first.value, function (err, res) {
+      first.settle(err, res);
+      done();
+    });
+    return;
+  }
+  // Reads of the same variable share a single bus read, and a snapshot
+  // serves the whole batch if the batch contains one
+  var vars = [];
+  var snapshot = false;
+  batch.forEach(function (req) {
+    if (req.op === 'snapshot') snapshot = true;
+    else if (vars.indexOf(req.v) < 0) vars.push(req.v);
+  });
+  if (!snapshot) {
+    var varBuf = Buffer.alloc(4 * vars.length);
+    var valueBuf = Buffer.alloc(4 * vars.length);
+    vars.forEach(function (v, i) {
+      varBuf['writeInt32' + os.endianness()](v, 4 * i);
+    });
+    lib.read_lifepo4wered_vars.async(vars.length, varBuf, valueBuf,
+                                     function (err) {
+      var values = err ? [] : readInts(valueBuf, vars.length);
+      batch.forEach(function (req) {
+        req.settle(err, values[vars.indexOf(req.v)]);
+      });
+      done();
+    });
+    return;
+  }
+  var buf = Buffer.alloc(4 * VAR_NAMES.length);
+  lib.read_lifepo4wered_snapshot.async(buf, function (err) {
+    var values = err ? [] : readInts(buf, VAR_NAMES.length);
+    batch.forEach(function (req) {
+      req.settle(err, req.op === 'read' ? values[req.v] :
+                 snapshotObject(values));
+    });
+    done();
+  });
+}
+
+// Take the next batch from the queue: a write, or all reads and
+// snapshots up to the next write, so ordering with writes is kept
+
+function nextBatch() {
+  if (queue[0].op === 'write') return queue.splice(0, 1);
+  var n = 0;
+  while (n < queue.length && queue[n].op !== 'write') n++;
+  return queue.splice(0, n);
+}
+
+// Process the queue until it is empty, one batch at a time
+
+function pump() {
+  if (busy || queue.length === 0) return;
+  busy = true;
+  if (!sessionOpen) {
+    sessionOpen = lib.open_lifepo4wered_session();
+  }
+  serve(nextBatch(), function () {
+    busy = false;
+    pump();
+  });
+}
+
+// Queue a request and return a promise for its result
+
+function request(op, v, value) {
+  return new Promise(function (resolve, reject) {
+    queue.push({ op: op, v: v, value: value, settle: function (err, res) {
+      if (err) reject(err); else resolve(res);
+    } });
+    pump();
+  });
+}
+
+// Convert snapshot values to an object keyed by variable name, leaving
+// out variables that are not available on the connected device
+
+function snapshotObject(values) {
+  var snapshot = {};
+  values.forEach(function (value, v) {
+    if (value !== -1) snapshot[VAR_NAMES[v]] = value;
+  });
+  return snapshot;
+}
+
+// Async iterator producing snapshots at a fixed interval (ms), which
+// must be a positive number
+
+function subscribe(interval) {
+  if (typeof interval !== 'number' || !isFinite(interval) || interval <= 0) {
+    throw new TypeError('subscribe interval must be a positive number of ms');
+  }
+  var next = Date.now();
+  var stopped = false;
+  var timer = null;
+  var wake = null;
+  return {
+    next: function () {
+      if (stopped) return Promise.resolve({ value: undefined, done: true });
+      var delay = Math.max(0, next - Date.now());
+      next = Math.max(next + interval, Date.now());
+      return new Promise(function (resolve) {
+        wake = resolve;
+        timer = setTimeout(resolve, delay);
+      }).then(function () {
+        timer = null;
+        if (stopped) return { value: undefined, done: true };
+        return request('snapshot').then(function (snapshot) {
+          return { value: snapshot, done: false };
+        });
+      });
+    },
+    return: function () {
+      stopped = true;
+      if (timer) {
+        clearTimeout(timer);
+        wake();
+      }
+      return Promise.resolve({ value: undefined, done: true });
+    },
+    [Symbol.asyncIterator]: function () { return this; }
+  };
+}
+
 // Export object
 
-module.exports = {
-
-  // Variable definitions
-
-  I2C_REG_VER           : 0,
-  I2C_ADDRESS           : 1,
-  LED_STATE             : 2,
-  TOUCH_STATE           : 3,
-  TOUCH_CAP_CYCLES      : 4,
-  TOUCH_THRESHOLD       : 5,
-  TOUCH_HYSTERESIS      : 6,
-  DCO_RSEL              : 7,
-  DCO_DCOMOD            : 8,
-  VIN                   : 9,
-  VBAT                  : 10,
-  VOUT                  : 11,
-  IOUT                  : 12,
-  VBAT_MIN              : 13,
-  VBAT_SHDN             : 14,
-  VBAT_BOOT             : 15,
-  VOUT_MAX              : 16,
-  VIN_THRESHOLD         : 17,
-  IOUT_SHDN_THRESHOLD   : 18,
-  VOFFSET_ADC           : 19,
-  VBAT_OFFSET           : 20,
-  VOUT_OFFSET           : 21,
-  VIN_OFFSET            : 22,
-  IOUT_OFFSET           : 23,
-  AUTO_BOOT             : 24,
-  WAKE_TIME             : 25,
-  SHDN_DELAY            : 26,
-  AUTO_SHDN_TIME        : 27,
-  PI_BOOT_TO            : 28,
-  PI_SHDN_TO            : 29,
-  RTC_TIME              : 30,
-  RTC_WAKE_TIME         : 31,
-  WATCHDOG_CFG          : 32,
-  WATCHDOG_GRACE        : 33,
-  WATCHDOG_TIMER        : 34,
-  PI_RUNNING            : 35,
-  CFG_WRITE             : 36,
-
-  // Touch states and masks
-
-  TOUCH_INACTIVE        : 0x00,
-  TOUCH_START           : 0x03,
-  TOUCH_STOP            : 0x0C,
-  TOUCH_HELD            : 0x0F,
-  TOUCH_ACTIVE_MASK     : 0x03,
-  TOUCH_MASK            : 0x0F,
-
-  // LED states when Pi on
-
-  LED_STATE_OFF         : 0x00,
-  LED_STATE_ON          : 0x01,
-  LED_STATE_PULSING     : 0x02,
-  LED_STATE_FLASHING    : 0x03,
-
-  // Auto boot settings
-
-  AUTO_BOOT_OFF         : 0x00,
-  AUTO_BOOT_VBAT        : 0x01,
-  AUTO_BOOT_VBAT_SMART  : 0x02,
-  AUTO_BOOT_VIN         : 0x03,
-  AUTO_BOOT_VIN_SMART   : 0x04,
-  AUTO_BOOT_NO_VIN      : 0x05,
-  AUTO_BOOT_NO_VIN_SMART: 0x06,
-
-  // Watchdog settings
-
-  WATCHDOG_OFF          : 0x00,
-  WATCHDOG_ALERT        : 0x01,
-  WATCHDOG_SHDN         : 0x02,
-
-  // Register access masks
-
-  ACCESS_READ           : 0x01,
-  ACCESS_WRITE          : 0x02,
+module.exports = Object.assign({}, regs.constants, {
 
   // Export access functions
 
   access_lifepo4wered   : lib.access_lifepo4wered,
   read_lifepo4wered     : lib.read_lifepo4wered,
-  write_lifepo4wered    : lib.write_lifepo4wered
+  write_lifepo4wered    : lib.write_lifepo4wered,
+
+  // Export asynchronous, promise based access functions
+
+  read                  : function (v) { return request('read', v); },
+  write                 : function (v, value) {
+                            return request('write', v, value); },
+  snapshot              : function () { return request('snapshot'); },
+  subscribe             : subscribe
+
+});
+
+// Variable names indexed by variable number
 
-};
+var VAR_NAMES = regs.VAR_NAMES;
 
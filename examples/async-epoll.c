@@ -0,0 +1,126 @@
+/*
+ * LiFePO4wered/Pi asynchronous access example
+ * Integrates the asynchronous API in an epoll event loop, keeping a
+ * number of requests outstanding and reporting their latency.
+ *
+ * Usage: async-epoll [outstanding requests] [total requests]
+ *
+ * Copyright (C) 2020 Patrick Van Oosterwijck
+ * Released under the GPL v2
+ */
+
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include "lifepo4wered-async.h"
+
+
+/* Request with its submission time */
+
+struct sTimedRequest {
+  struct sLiFePO4weredRequest req;
+  int32_t                     values[LFP_VAR_COUNT];
+  uint64_t                    submitted;
+};
+
+/* Get the monotonic time in us */
+
+static uint64_t monotonic_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Submit a request: mostly reads of the measurements, with an
+ * occasional snapshot */
+
+static void submit(struct sTimedRequest *tr, int n) {
+  static const enum eLiFePO4weredVar vars[] = { VIN, VBAT, VOUT, IOUT };
+  tr->req.op = n % 10 == 0 ? LFP_ASYNC_SNAPSHOT : LFP_ASYNC_READ;
+  tr->req.var = vars[n % 4];
+  tr->req.values = tr->values;
+  tr->req.user_data = tr;
+  tr->submitted = monotonic_us();
+  lifepo4wered_async_submit(&tr->req);
+}
+
+/* Compare latencies for sorting */
+
+static int compare_latency(const void *a, const void *b) {
+  uint64_t la = *(const uint64_t *)a, lb = *(const uint64_t *)b;
+  return la < lb ? -1 : la > lb;
+}
+
+/* Program entry point */
+
+int main(int argc, char *argv[]) {
+  int outstanding = argc > 1 ? atoi(argv[1]) : 64;
+  int total = argc > 2 ? atoi(argv[2]) : 1000;
+  if (outstanding < 1 || total < outstanding) {
+    fprintf(stderr, "Usage: %s [outstanding requests] [total requests]\n",
+            argv[0]);
+    return 1;
+  }
+
+  int event_fd = lifepo4wered_async_open();
+  if (event_fd < 0) {
+    perror("lifepo4wered_async_open");
+    return 2;
+  }
+  int epoll_fd = epoll_create1(0);
+  struct epoll_event ev = { .events = EPOLLIN, .data.fd = event_fd };
+  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, event_fd, &ev);
+
+  struct sTimedRequest *reqs = calloc(outstanding, sizeof(*reqs));
+  uint64_t *latency = calloc(total, sizeof(*latency));
+  int submitted = 0, completed = 0, errors = 0;
+  uint64_t start = monotonic_us();
+  for (; submitted < outstanding; submitted++) {
+    submit(&reqs[submitted], submitted);
+  }
+
+  /* Event loop: other file descriptors would be added to the same epoll
+   * set, and never get blocked by bus I/O */
+  while (completed < total) {
+    struct epoll_event events[8];
+    int n = epoll_wait(epoll_fd, events, 8, -1);
+    for (int i = 0; i < n; i++) {
+      if (events[i].data.fd != event_fd) continue;
+      uint64_t count;
+      if (read(event_fd, &count, sizeof(count)) < 0) continue;
+      struct sLiFePO4weredRequest *req;
+      while ((req = lifepo4wered_async_complete())) {
+        struct sTimedRequest *tr = req->user_data;
+        latency[completed++] = monotonic_us() - tr->submitted;
+        if (req->op == LFP_ASYNC_READ ? req->value < 0 :
+            req->values[VBAT] < 0)
+          errors++;
+        /* Keep the number of outstanding requests constant */
+        if (submitted < total) submit(tr, submitted++);
+      }
+    }
+  }
+  uint64_t elapsed = monotonic_us() - start;
+
+  lifepo4wered_async_close();
+  close(epoll_fd);
+
+  qsort(latency, total, sizeof(*latency), compare_latency);
+  uint64_t sum = 0;
+  for (int i = 0; i < total; i++) sum += latency[i];
+  printf("%d requests, %d outstanding, %d errors, %.1f requests/s\n",
+         total, outstanding, errors, total * 1e6 / elapsed);
+  printf("Latency (us): min %llu, avg %llu, p50 %llu, p99 %llu, max %llu\n",
+         (unsigned long long)latency[0],
+         (unsigned long long)(sum / total),
+         (unsigned long long)latency[total / 2],
+         (unsigned long long)latency[total * 99 / 100],
+         (unsigned long long)latency[total - 1]);
+
+  free(reqs);
+  free(latency);
+  return errors ? 3 : 0;
+}
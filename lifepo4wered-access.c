@@ -15,10 +15,16 @@
 #else
 #define TOBUFTYPE(x) ((char *)(x))
 #endif
+#include <errno.h>
 #include <string.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "lifepo4wered-access.h"
+#include "lifepo4wered-trace.h"
 
 
 /* LiFePO4wered/Pi access constants */
@@ -27,16 +33,473 @@
 #define I2C_ADDRESS         0x43
 #define I2C_WR_UNLOCK       0xC9
 
+/* Shared bus state file in a runtime directory only root can create,
+ * and the environment variables to override its location (empty to
+ * disable) and to set the bus time budget */
+
+#define BUS_STATE_DIR       "/run/lifepo4wered"
+#define BUS_STATE_PATH      BUS_STATE_DIR "/bus"
+#define BUS_STATE_ENV       "LIFEPO4WERED_BUS_STATE"
+#define BUS_BUDGET_ENV      "LIFEPO4WERED_BUS_BUDGET"
+#define BUS_STATE_MAGIC     0x4250464C
+#define BUS_STATE_VERSION   1
+
+/* Maximum age (ns) of cached register data */
+
+#define BUS_CACHE_MAX_AGE   60000000000ULL
+
+/* Maximum number of chunks a chunked read is split into */
+
+#define I2C_MAX_CHUNKS      ((UINT8_MAX + I2C_SMBUS_BLOCK_MAX - 1) / \
+                              I2C_SMBUS_BLOCK_MAX)
+
+
+/* I2C transfer mode names */
+
+const char *lifepo4wered_i2c_mode_name[I2C_MODE_COUNT] = {
+  "auto",
+  "rdwr-block",
+  "rdwr-chunked",
+  "smbus-block",
+  "smbus-byte"
+};
+
+/* Bus file kept open by a persistent session, -1 if none is open */
+
+static int session_file = -1;
+
+/* Adapter capabilities and the transfer mode selected for them */
+
+static struct {
+  bool            probed;         /* Capabilities have been queried */
+  bool            forced;         /* Mode was forced, don't fall back */
+  unsigned long   funcs;          /* I2C_FUNCS functionality mask */
+  enum eI2CMode   mode;           /* Transfer mode in use */
+  uint8_t         max_read_len;   /* Read message length limit, 0 if none */
+  int             slave_file;     /* Bus file with the slave address set */
+} adapter = { false, false, 0, I2C_MODE_AUTO, 0, -1 };
+
+/* Bus state shared by all users of the library through a mapped file:
+ * the bus time token bucket, occupancy statistics and a cache of
+ * validated register data.  Access is serialized by locking the file. */
+
+struct sBusState {
+  uint32_t                      magic;
+  uint32_t                      version;
+  uint64_t                      refill_time;      /* Last refill (ns) */
+  struct sLiFePO4weredBusStats  stats;
+  uint64_t                      cache_time[256];  /* Time (ns) register
+                                                     was cached, 0 if not */
+  uint8_t                       cache[256];
+};
+
+static struct {
+  bool              initialized;
+  int               fd;
+  struct sBusState  *state;         /* Mapped shared state, or NULL */
+  enum eBusPriority priority;       /* Minimum priority of reads */
+} bus = { false, -1, NULL, BUS_PRIORITY_LOW };
+
+/* Transfer trace state */
+
+static struct {
+  bool            initialized;
+  int             record_fd;      /* Trace file being recorded, or -1 */
+  const uint8_t   *replay;        /* Mapped trace being replayed */
+  size_t          replay_size;
+  size_t          replay_pos;
+  double          replay_speed;   /* Replay speed factor, 0 is unpaced */
+  uint64_t        replay_t0;      /* First record timestamp */
+  uint64_t        replay_start;   /* Monotonic time replay started */
+} trace = { false, -1 };
+
+
+/* Get the monotonic time in ns */
+
+static uint64_t monotonic_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Open a trace file for recording, writing the header if it is new */
+
+static void open_trace_record(const char *path) {
+  int fd = open(path, O_WRONLY|O_CREAT|O_APPEND, 0644);
+  if (fd < 0) return;
+  struct stat st;
+  if (fstat(fd, &st) == 0 && st.st_size == 0) {
+    struct sTraceHeader hdr = { TRACE_MAGIC, TRACE_VERSION };
+    if (write(fd, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+      close(fd);
+      return;
+    }
+  }
+  trace.record_fd = fd;
+}
+
+/* Map a trace file for replay */
+
+static void open_trace_replay(const char *path, const char *speed) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) return;
+  struct stat st;
+  if (fstat(fd, &st) == 0 && st.st_size >= sizeof(struct sTraceHeader)) {
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map != MAP_FAILED) {
+      const struct sTraceHeader *hdr = map;
+      if (hdr->magic == TRACE_MAGIC && hdr->version == TRACE_VERSION) {
+        trace.replay = map;
+        trace.replay_size = st.st_size;
+        trace.replay_pos = sizeof(struct sTraceHeader);
+        trace.replay_speed = speed ? strtod(speed, NULL) : 1.0;
+      } else {
+        munmap(map, st.st_size);
+      }
+    }
+  }
+  close(fd);
+}
+
+/* Set up recording or replay of transfers as requested through the
+ * environment, the first time the bus is accessed */
+
+static void init_trace(void) {
+  if (trace.initialized) return;
+  trace.initialized = true;
+  const char *replay = getenv(TRACE_ENV_REPLAY);
+  const char *record = getenv(TRACE_ENV_RECORD);
+  if (replay) {
+    open_trace_replay(replay, getenv(TRACE_ENV_REPLAY_SPEED));
+  } else if (record) {
+    open_trace_record(record);
+  }
+}
+
+/* Record a transfer to the trace file.  Each record is appended with a
+ * single write, so multiple processes can record to the same file. */
+
+static void record_transfer(uint8_t op, uint8_t reg, uint8_t count,
+                            const uint8_t *data, uint8_t result,
+                            uint8_t retry, uint64_t t_start,
+                            uint64_t t_locked, uint64_t t_end) {
+  uint8_t buf[sizeof(struct sTraceRecord) + 255];
+  struct sTraceRecord *rec = (struct sTraceRecord *)buf;
+  rec->timestamp = t_start;
+  rec->lock_wait = t_locked - t_start;
+  rec->duration = t_end - t_locked;
+  rec->op = op;
+  rec->reg = reg;
+  rec->count = count;
+  rec->result = result;
+  rec->retry = retry;
+  size_t len = sizeof(struct sTraceRecord);
+  if (TRACE_HAS_PAYLOAD(rec)) {
+    memcpy(&buf[len], data, count);
+    len += count;
+  }
+  if (write(trace.record_fd, buf, len) != len) {
+    /* Stop recording rather than produce a corrupt trace */
+    close(trace.record_fd);
+    trace.record_fd = -1;
+  }
+}
+
+/* Serve a transfer from the trace being replayed: find the next record
+ * for the same operation and register, wait until its time (scaled by
+ * the replay speed) and return its result */
+
+static bool replay_transfer(uint8_t op, uint8_t reg, uint8_t count,
+                            uint8_t *data) {
+  while (trace.replay_pos + sizeof(struct sTraceRecord) <= trace.replay_size) {
+    const struct sTraceRecord *rec =
+            (const struct sTraceRecord *)&trace.replay[trace.replay_pos];
+    size_t len = sizeof(struct sTraceRecord) +
+                  (TRACE_HAS_PAYLOAD(rec) ? rec->count : 0);
+    if (trace.replay_pos + len > trace.replay_size) break;
+    trace.replay_pos += len;
+    if ((rec->op & TRACE_OP_MASK) != op || rec->reg != reg ||
+        rec->count != count)
+      continue;
+    /* Pace the replay like the original */
+    if (!trace.replay_start) {
+      trace.replay_start = monotonic_ns();
+      trace.replay_t0 = rec->timestamp;
+    }
+    if (trace.replay_speed > 0) {
+      uint64_t due = trace.replay_start + (uint64_t)((rec->timestamp +
+                      rec->lock_wait + rec->duration - trace.replay_t0) /
+                      trace.replay_speed);
+      uint64_t now = monotonic_ns();
+      if (due > now) {
+        struct timespec ts = { (due - now) / 1000000000,
+                               (due - now) % 1000000000 };
+        nanosleep(&ts, NULL);
+      }
+    }
+    if (rec->result != TRACE_OK) return false;
+    if (op == TRACE_OP_READ) memcpy(data, rec + 1, count);
+    return true;
+  }
+  /* End of the trace */
+  return false;
+}
+
+/* Give a new bus state file the group and permissions of the bus
+ * device, so every process that can use the bus shares the state */
+
+static void share_bus_state(int fd) {
+  char filename[20];
+  snprintf(filename, 19, "/dev/i2c-%d", I2C_BUS);
+  struct stat st;
+  if (stat(filename, &st) == 0) {
+    /* Only open the file up to the group if it is the device's group */
+    mode_t mode = st.st_mode & 0606;
+    if (fchown(fd, -1, st.st_gid) == 0)
+      mode |= st.st_mode & 0060;
+    fchmod(fd, mode);
+  }
+}
+
+/* Map the shared bus state the first time it is needed, initializing
+ * the file if it is new or from a different version.  Only processes
+ * that can open the bus share its state, and only a regular file owned
+ * by root or this user, with the expected size unless it is new or our
+ * own, is mapped. */
+
+static void init_bus_state(void) {
+  if (bus.initialized) return;
+  bus.initialized = true;
+  const char *path = getenv(BUS_STATE_ENV);
+  bool default_path = !path;
+  if (default_path) path = BUS_STATE_PATH;
+  if (!*path) return;
+  char filename[20];
+  snprintf(filename, 19, "/dev/i2c-%d", I2C_BUS);
+  int dev = open(filename, O_RDWR|O_CLOEXEC);
+  if (dev < 0) return;
+  close(dev);
+  if (default_path)
+    mkdir(BUS_STATE_DIR, 0755);
+  int fd = open(path, O_RDWR|O_CREAT|O_NOFOLLOW|O_CLOEXEC, 0600);
+  if (fd < 0) return;
+  flock(fd, LOCK_EX);
+  struct stat st;
+  void *map = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) &&
+      (st.st_uid == 0 || st.st_uid == geteuid())) {
+    if (st.st_size == 0)
+      share_bus_state(fd);
+    if (st.st_size == sizeof(struct sBusState) ||
+        ((st.st_size == 0 || st.st_uid == geteuid()) &&
+         ftruncate(fd, sizeof(struct sBusState)) == 0))
+      map = mmap(NULL, sizeof(struct sBusState), PROT_READ|PROT_WRITE,
+                 MAP_SHARED, fd, 0);
+  }
+  if (map != MAP_FAILED) {
+    struct sBusState *state = map;
+    if (state->magic != BUS_STATE_MAGIC ||
+        state->version != BUS_STATE_VERSION) {
+      memset(state, 0, sizeof(*state));
+      state->magic = BUS_STATE_MAGIC;
+      state->version = BUS_STATE_VERSION;
+      state->refill_time = monotonic_ns();
+      state->stats.since = state->refill_time / 1000;
+    }
+    bus.state = state;
+    bus.fd = fd;
+  }
+  flock(fd, LOCK_UN);
+  if (!bus.state) {
+    close(fd);
+    return;
+  }
+  const char *budget = getenv(BUS_BUDGET_ENV);
+  if (budget)
+    set_lifepo4wered_bus_budget(strtoul(budget, NULL, 0));
+}
+
+/* Lock the shared bus state, returns false if there is none.  A trace
+ * replay doesn't use the bus, so it leaves the shared state alone. */
+
+static bool lock_bus_state(void) {
+  init_trace();
+  init_bus_state();
+  if (!bus.state || trace.replay)
+    return false;
+  flock(bus.fd, LOCK_EX);
+  return true;
+}
+
+/* Unlock the shared bus state */
+
+static void unlock_bus_state(void) {
+  flock(bus.fd, LOCK_UN);
+}
+
+/* Add the bus time earned since the last refill to the token bucket,
+ * which holds up to one second of budget */
+
+static void refill_bus_budget(uint64_t now) {
+  struct sBusState *state = bus.state;
+  int64_t budget = state->stats.budget;
+  uint64_t elapsed = now - state->refill_time;
+  if (!budget || elapsed >= 1000000000) {
+    state->stats.tokens = budget;
+    state->refill_time = now;
+    return;
+  }
+  /* Only advance the refill time by the time worth of whole tokens, so
+   * frequent refills don't lose the fractions */
+  int64_t earned = elapsed * budget / 1000000000;
+  state->stats.tokens += earned;
+  state->refill_time += earned * 1000000000 / budget;
+  if (state->stats.tokens >= budget) {
+    state->stats.tokens = budget;
+    state->refill_time = now;
+  }
+}
+
+/* Check whether a transfer with the specified priority can use the bus.
+ * Low priority transfers are refused when the budget is used up, high
+ * priority ones always go through. */
+
+static bool take_bus_budget(enum eBusPriority priority) {
+  if (!lock_bus_state())
+    return true;
+  refill_bus_budget(monotonic_ns());
+  struct sLiFePO4weredBusStats *stats = &bus.state->stats;
+  bool allowed = !stats->budget || stats->tokens > 0 ||
+                  priority == BUS_PRIORITY_HIGH;
+  if (!allowed) {
+    stats->refused++;
+  } else if (stats->budget && stats->tokens <= 0) {
+    stats->over_budget++;
+  }
+  unlock_bus_state();
+  if (!allowed)
+    errno = EDQUOT;
+  return allowed;
+}
+
+/* Charge the time (ns) a transfer held the bus, and drop the cached data
+ * of registers that were written */
+
+static void charge_bus_time(uint64_t duration, uint8_t written_reg,
+                            uint8_t written_count) {
+  int saved_errno = errno;
+  if (lock_bus_state()) {
+    struct sLiFePO4weredBusStats *stats = &bus.state->stats;
+    uint64_t us = (duration + 999) / 1000;
+    stats->busy += us;
+    stats->transfers++;
+    if (stats->budget)
+      stats->tokens -= us;
+    for (int i = 0; i < written_count && written_reg + i < 256; i++) {
+      bus.state->cache_time[written_reg + i] = 0;
+    }
+    unlock_bus_state();
+  }
+  errno = saved_errno;
+}
+
+/* Determine if the adapter supports the transfer mode */
+
+static bool mode_supported(enum eI2CMode mode) {
+  switch (mode) {
+    case I2C_MODE_RDWR_BLOCK:
+    case I2C_MODE_RDWR_CHUNKED:
+      return adapter.funcs & I2C_FUNC_I2C;
+    case I2C_MODE_SMBUS_BLOCK:
+      return (adapter.funcs & I2C_FUNC_SMBUS_I2C_BLOCK) ==
+              I2C_FUNC_SMBUS_I2C_BLOCK;
+    case I2C_MODE_SMBUS_BYTE:
+      return (adapter.funcs & I2C_FUNC_SMBUS_BYTE_DATA) ==
+              I2C_FUNC_SMBUS_BYTE_DATA;
+    default:
+      return false;
+  }
+}
+
+/* Get the first supported transfer mode starting from the specified
+ * one, or I2C_MODE_COUNT if there is none */
+
+static enum eI2CMode next_supported_mode(enum eI2CMode mode) {
+  while (mode < I2C_MODE_COUNT && !mode_supported(mode))
+    mode++;
+  return mode;
+}
+
+/* Query the adapter functionality and select the transfer mode */
+
+static void probe_adapter(int file) {
+  unsigned long funcs;
+  /* Assume plain I2C if the adapter can't tell, that's what we always
+   * used */
+  adapter.funcs = ioctl(file, I2C_FUNCS, &funcs) >= 0 ? funcs : I2C_FUNC_I2C;
+  adapter.max_read_len = 0;
+  adapter.probed = true;
+  /* Keep a forced mode if the adapter supports it */
+  if (adapter.forced && mode_supported(adapter.mode))
+    return;
+  adapter.forced = false;
+  /* A mode can be forced from the environment */
+  const char *env = getenv("LIFEPO4WERED_I2C_MODE");
+  for (enum eI2CMode mode = I2C_MODE_RDWR_BLOCK; env && mode < I2C_MODE_COUNT;
+       mode++) {
+    if (strcmp(env, lifepo4wered_i2c_mode_name[mode]) == 0 &&
+        mode_supported(mode)) {
+      adapter.mode = mode;
+      adapter.forced = true;
+      return;
+    }
+  }
+  /* Otherwise use the fastest mode */
+  enum eI2CMode mode = next_supported_mode(I2C_MODE_RDWR_BLOCK);
+  adapter.mode = mode < I2C_MODE_COUNT ? mode : I2C_MODE_RDWR_BLOCK;
+}
+
+/* Fall back to the next supported transfer mode after the adapter
+ * rejected a transfer.  Bus errors such as a NACK don't change the
+ * mode, only errors caused by the type of transfer. */
+
+static bool fall_back_mode(uint8_t read_count) {
+  if (adapter.forced || (errno != EOPNOTSUPP && errno != EINVAL))
+    return false;
+  enum eI2CMode mode = adapter.mode + 1;
+  /* Splitting the block only helps if the adapter rejected a long read */
+  if (adapter.mode == I2C_MODE_RDWR_BLOCK &&
+      read_count > I2C_SMBUS_BLOCK_MAX) {
+    adapter.max_read_len = I2C_SMBUS_BLOCK_MAX;
+  } else if (mode == I2C_MODE_RDWR_CHUNKED) {
+    mode++;
+  }
+  mode = next_supported_mode(mode);
+  if (mode == I2C_MODE_COUNT)
+    return false;
+  adapter.mode = mode;
+  return true;
+}
 
 /* Open access to the specified I2C bus */
 
 static bool open_i2c_bus(int bus, int *file) {
+  /* If a session is open, we only need to lock access */
+  if (session_file >= 0) {
+    *file = session_file;
+    if (!adapter.probed)
+      probe_adapter(*file);
+    return flock(*file, LOCK_EX|LOCK_NB) == 0;
+  }
   /* Create the name of the device file */
   char filename[20];
   snprintf(filename, 19, "/dev/i2c-%d", bus);
   /* Open the device file */
   *file = open(filename, O_RDWR);
   if (*file < 0) return false;
+  /* Query the adapter the first time */
+  if (!adapter.probed)
+    probe_adapter(*file);
   /* Lock access */
   if (flock(*file, LOCK_EX|LOCK_NB) != 0) {
     close (*file);
@@ -50,40 +513,324 @@ static bool open_i2c_bus(int bus, int *file) {
 
 static bool close_i2c_bus(int file) {
   flock(file, LOCK_UN);
-  close(file);
+  /* Keep the file open if it belongs to the session */
+  if (file != session_file) {
+    close(file);
+    if (file == adapter.slave_file)
+      adapter.slave_file = -1;
+  }
   return file >= 0;
 }
 
+/* Open a persistent session that keeps the I2C bus open between
+ * transfers */
+
+bool open_lifepo4wered_session(void) {
+  if (session_file >= 0)
+    return true;
+  char filename[20];
+  snprintf(filename, 19, "/dev/i2c-%d", I2C_BUS);
+  session_file = open(filename, O_RDWR);
+  /* Query the adapter again for the new session */
+  adapter.probed = false;
+  return session_file >= 0;
+}
+
+/* Close the persistent session */
+
+void close_lifepo4wered_session(void) {
+  if (session_file >= 0) {
+    close(session_file);
+    if (session_file == adapter.slave_file)
+      adapter.slave_file = -1;
+    session_file = -1;
+  }
+}
+
+/* Get the I2C transfer mode in use */
+
+enum eI2CMode get_lifepo4wered_i2c_mode(void) {
+  if (!adapter.probed) {
+    int file;
+    if (open_i2c_bus(I2C_BUS, &file))
+      close_i2c_bus(file);
+  }
+  return adapter.probed ? adapter.mode : I2C_MODE_AUTO;
+}
+
+/* Force the I2C transfer mode or return to automatic selection */
+
+bool set_lifepo4wered_i2c_mode(enum eI2CMode mode) {
+  if (mode == I2C_MODE_AUTO) {
+    adapter.forced = false;
+    adapter.probed = false;
+    return get_lifepo4wered_i2c_mode() != I2C_MODE_AUTO;
+  }
+  if (mode >= I2C_MODE_COUNT || get_lifepo4wered_i2c_mode() == I2C_MODE_AUTO ||
+      !mode_supported(mode))
+    return false;
+  adapter.mode = mode;
+  adapter.forced = true;
+  return true;
+}
+
+/* Get the bus occupancy statistics */
+
+bool get_lifepo4wered_bus_stats(struct sLiFePO4weredBusStats *stats) {
+  if (!lock_bus_state())
+    return false;
+  refill_bus_budget(monotonic_ns());
+  *stats = bus.state->stats;
+  unlock_bus_state();
+  return true;
+}
+
+/* Set the bus time budget for all users of the library */
+
+bool set_lifepo4wered_bus_budget(uint32_t budget) {
+  if (budget > 1000000)
+    budget = 1000000;
+  if (!lock_bus_state())
+    return false;
+  bus.state->stats.budget = budget;
+  bus.state->stats.tokens = budget;
+  bus.state->refill_time = monotonic_ns();
+  unlock_bus_state();
+  return true;
+}
+
+/* Raise the priority of all reads by this process */
+
+void set_lifepo4wered_bus_priority(enum eBusPriority priority) {
+  bus.priority = priority;
+}
+
+/* Save validated register data in the shared cache */
+
+void cache_lifepo4wered_data(uint8_t reg, uint8_t count,
+                             const uint8_t *data) {
+  if (!lock_bus_state())
+    return;
+  uint64_t now = monotonic_ns();
+  for (int i = 0; i < count && reg + i < 256; i++) {
+    bus.state->cache[reg + i] = data[i];
+    bus.state->cache_time[reg + i] = now;
+  }
+  unlock_bus_state();
+}
+
+/* Get register data from the shared cache */
+
+bool cached_lifepo4wered_data(uint8_t reg, uint8_t count, uint8_t *data) {
+  if (!lock_bus_state())
+    return false;
+  uint64_t now = monotonic_ns();
+  bool cached = reg + count <= 256;
+  for (int i = 0; i < count && cached; i++) {
+    uint64_t t = bus.state->cache_time[reg + i];
+    cached = t && now - t <= BUS_CACHE_MAX_AGE;
+  }
+  if (cached) {
+    memcpy(data, &bus.state->cache[reg], count);
+    bus.state->stats.cached++;
+  }
+  unlock_bus_state();
+  return cached;
+}
+
+/* Set the slave address on the bus file for SMBus transfers */
+
+static bool set_slave_address(int file) {
+  if (file == adapter.slave_file)
+    return true;
+  if (ioctl(file, I2C_SLAVE, I2C_ADDRESS) < 0)
+    return false;
+  adapter.slave_file = file;
+  return true;
+}
+
+/* Execute an SMBus transfer */
+
+static bool smbus_transfer(int file, uint8_t read_write, uint8_t command,
+                           uint32_t size, union i2c_smbus_data *data) {
+  struct i2c_smbus_ioctl_data args = {
+    read_write,
+    command,
+    size,
+    data
+  };
+  return ioctl(file, I2C_SMBUS, &args) >= 0;
+}
+
+/* Read data with I2C_RDWR, in one message or in chunks */
+
+static bool rdwr_read(int file, uint8_t reg, uint8_t count, uint8_t *data) {
+  uint8_t chunk_len = count;
+  if (adapter.mode == I2C_MODE_RDWR_CHUNKED)
+    chunk_len = adapter.max_read_len ? adapter.max_read_len
+                                     : I2C_SMBUS_BLOCK_MAX;
+  uint8_t regs[I2C_MAX_CHUNKS];
+  struct i2c_msg msgs[2 * I2C_MAX_CHUNKS];
+  struct i2c_rdwr_ioctl_data rdwr = {
+    msgs,
+    0
+  };
+  /* Each chunk gets a write register message and a read data message */
+  for (int done = 0; done < count; done += chunk_len) {
+    int n = rdwr.nmsgs / 2;
+    regs[n] = reg + done;
+    msgs[2 * n].addr = I2C_ADDRESS;
+    msgs[2 * n].flags = 0;
+    msgs[2 * n].len = 1;
+    msgs[2 * n].buf = TOBUFTYPE(&regs[n]);
+    msgs[2 * n + 1].addr = I2C_ADDRESS;
+    msgs[2 * n + 1].flags = I2C_M_RD;
+    msgs[2 * n + 1].len = count - done < chunk_len ? count - done : chunk_len;
+    msgs[2 * n + 1].buf = TOBUFTYPE(&data[done]);
+    rdwr.nmsgs += 2;
+  }
+  return ioctl(file, I2C_RDWR, &rdwr) >= 0;
+}
+
+/* Read data with SMBus I2C block or single register transfers */
+
+static bool smbus_read(int file, uint8_t reg, uint8_t count, uint8_t *data) {
+  if (!set_slave_address(file))
+    return false;
+  union i2c_smbus_data buf;
+  if (adapter.mode == I2C_MODE_SMBUS_BYTE) {
+    for (int i = 0; i < count; i++) {
+      if (!smbus_transfer(file, I2C_SMBUS_READ, reg + i,
+                          I2C_SMBUS_BYTE_DATA, &buf))
+        return false;
+      data[i] = buf.byte;
+    }
+    return true;
+  }
+  for (int done = 0; done < count; done += I2C_SMBUS_BLOCK_MAX) {
+    uint8_t len = count - done < I2C_SMBUS_BLOCK_MAX ? count - done
+                                                     : I2C_SMBUS_BLOCK_MAX;
+    buf.block[0] = len;
+    if (!smbus_transfer(file, I2C_SMBUS_READ, reg + done,
+                        I2C_SMBUS_I2C_BLOCK_DATA, &buf))
+      return false;
+    memcpy(&data[done], &buf.block[1], len);
+  }
+  return true;
+}
+
+/* Write a register and its payload with I2C_RDWR */
+
+static bool rdwr_write(int file, uint8_t *payload, uint8_t len) {
+  struct i2c_msg dwrite;
+  struct i2c_rdwr_ioctl_data msgwrite = {
+    &dwrite,
+    1
+  };
+  dwrite.addr = I2C_ADDRESS;
+  dwrite.flags = 0;
+  dwrite.len = len;
+  dwrite.buf = TOBUFTYPE(payload);
+  return ioctl(file, I2C_RDWR, &msgwrite) >= 0;
+}
+
+/* Write a register and its payload with the current transfer mode
+ * Adapters may support fewer SMBus writes than reads, so the write
+ * transfer is picked from what the adapter reports it can write.  The
+ * payload can't be split over several transfers without breaking the
+ * unlock sequence. */
+
+static bool mode_write(int file, uint8_t *payload, uint8_t len) {
+  if (adapter.mode == I2C_MODE_RDWR_BLOCK ||
+      adapter.mode == I2C_MODE_RDWR_CHUNKED)
+    return rdwr_write(file, payload, len);
+  if (!set_slave_address(file))
+    return false;
+  /* The first payload byte is the SMBus command, the rest is data */
+  union i2c_smbus_data buf;
+  uint8_t count = len - 1;
+  bool block = count <= I2C_SMBUS_BLOCK_MAX &&
+                (adapter.funcs & I2C_FUNC_SMBUS_WRITE_I2C_BLOCK);
+  bool small = adapter.mode == I2C_MODE_SMBUS_BYTE || !block;
+  if (small && count == 1 &&
+      (adapter.funcs & I2C_FUNC_SMBUS_WRITE_BYTE_DATA)) {
+    buf.byte = payload[1];
+    return smbus_transfer(file, I2C_SMBUS_WRITE, payload[0],
+                          I2C_SMBUS_BYTE_DATA, &buf);
+  }
+  if (small && count == 2 &&
+      (adapter.funcs & I2C_FUNC_SMBUS_WRITE_WORD_DATA)) {
+    buf.word = payload[1] | (payload[2] << 8);
+    return smbus_transfer(file, I2C_SMBUS_WRITE, payload[0],
+                          I2C_SMBUS_WORD_DATA, &buf);
+  }
+  if (block) {
+    buf.block[0] = count;
+    memcpy(&buf.block[1], &payload[1], count);
+    return smbus_transfer(file, I2C_SMBUS_WRITE, payload[0],
+                          I2C_SMBUS_I2C_BLOCK_DATA, &buf);
+  }
+  /* A plain I2C write if no SMBus write fits, for instance when an
+   * SMBus mode was forced on a full I2C adapter */
+  if (adapter.funcs & I2C_FUNC_I2C)
+    return rdwr_write(file, payload, len);
+  errno = EOPNOTSUPP;
+  return false;
+}
+
+/* Read data with the current transfer mode */
+
+static bool mode_read(int file, uint8_t reg, uint8_t count, uint8_t *data) {
+  if (adapter.mode == I2C_MODE_RDWR_BLOCK ||
+      adapter.mode == I2C_MODE_RDWR_CHUNKED)
+    return rdwr_read(file, reg, count, data);
+  return smbus_read(file, reg, count, data);
+}
+
 /* Read LiFePO4wered/Pi data */
 
-bool read_lifepo4wered_data(uint8_t reg, uint8_t count, uint8_t *data) {
+bool read_lifepo4wered_data(uint8_t reg, uint8_t count, uint8_t *data,
+                            enum eBusPriority priority, uint8_t retry) {
+  /* Serve from the trace if one is being replayed */
+  init_trace();
+  if (trace.replay)
+    return replay_transfer(TRACE_OP_READ, reg, count, data);
+  bool tracing = trace.record_fd >= 0;
+
+  /* Leave the bus to other devices if the budget is used up */
+  if (!take_bus_budget(priority > bus.priority ? priority : bus.priority))
+    return false;
+  uint64_t t_start = monotonic_ns();
+
   /* Open the I2C bus */
   int file;
-  if (!open_i2c_bus(I2C_BUS, &file))
+  if (!open_i2c_bus(I2C_BUS, &file)) {
+    if (tracing) {
+      uint64_t t_fail = monotonic_ns();
+      record_transfer(TRACE_OP_READ, reg, count, data, TRACE_EBUS,
+                      retry, t_start, t_fail, t_fail);
+    }
     return false;
+  }
+  uint64_t t_locked = monotonic_ns();
 
-  /* Declare I2C message structures */
-  struct i2c_msg dread[2];
-  struct i2c_rdwr_ioctl_data msgread = {
-    dread,
-    2
-  };
-  /* Write register message */
-  dread[0].addr = I2C_ADDRESS;
-  dread[0].flags = 0;
-  dread[0].len = 1;
-  dread[0].buf = TOBUFTYPE(&reg);
-  /* Read data message */
-  dread[1].addr = I2C_ADDRESS;
-  dread[1].flags = I2C_M_RD;
-  dread[1].len = count;
-  dread[1].buf = TOBUFTYPE(data);
-
-  /* Execute the command to send the register */
-  bool result = ioctl(file, I2C_RDWR, &msgread) >= 0;
+  /* Read the data, falling back to a more compatible transfer mode if
+   * the adapter doesn't support the current one */
+  bool result;
+  do {
+    result = mode_read(file, reg, count, data);
+  } while (!result && fall_back_mode(count));
+  uint64_t t_end = monotonic_ns();
 
   /* Close the I2C bus */
   close_i2c_bus(file);
+  charge_bus_time(t_end - t_locked, 0, 0);
+
+  /* Record the transfer if we're tracing */
+  if (tracing)
+    record_transfer(TRACE_OP_READ, reg, count, data,
+                    result ? TRACE_OK : TRACE_EXFER, retry,
+                    t_start, t_locked, t_end);
 
   /* Return the result */
   return result;
@@ -92,35 +839,54 @@ bool read_lifepo4wered_data(uint8_t reg, uint8_t count, uint8_t *data) {
 /* Write LiFePO4wered/Pi chip data */
 
 bool write_lifepo4wered_data(uint8_t reg, uint8_t count, uint8_t *data,
-                              bool unlock) {
+                              bool unlock, uint8_t retry) {
+  /* Serve from the trace if one is being replayed */
+  init_trace();
+  if (trace.replay)
+    return replay_transfer(TRACE_OP_WRITE, reg, count, data);
+  bool tracing = trace.record_fd >= 0;
+  uint8_t trace_op = TRACE_OP_WRITE | (unlock ? TRACE_OP_UNLOCK : 0);
+
+  /* Writes always go through, but are accounted against the budget */
+  take_bus_budget(BUS_PRIORITY_HIGH);
+  uint64_t t_start = monotonic_ns();
+
   /* Open the I2C bus */
   int file;
-  if (!open_i2c_bus(I2C_BUS, &file))
+  if (!open_i2c_bus(I2C_BUS, &file)) {
+    if (tracing) {
+      uint64_t t_fail = monotonic_ns();
+      record_transfer(trace_op, reg, count, data, TRACE_EBUS,
+                      retry, t_start, t_fail, t_fail);
+    }
     return false;
+  }
+  uint64_t t_locked = monotonic_ns();
 
-  /* Declare I2C message structures */
-  struct i2c_msg dwrite;
-  struct i2c_rdwr_ioctl_data msgwrite = {
-    &dwrite,
-    1
-  };
   /* Message payload */
   uint8_t payload[255];
   uint8_t header_len = unlock ? 2 : 1;
   payload[0] = reg;
   payload[1] = (I2C_ADDRESS << 1) ^ I2C_WR_UNLOCK ^ reg;
   memcpy(&payload[header_len], data, count);
-  /* Write data message */
-  dwrite.addr = I2C_ADDRESS;
-  dwrite.flags = 0;
-  dwrite.len = header_len + count;
-  dwrite.buf = TOBUFTYPE(payload);
 
-  /* Execute the command */
-  bool result = ioctl(file, I2C_RDWR, &msgwrite) >= 0;
+  /* Write the data, falling back to a more compatible transfer mode if
+   * the adapter doesn't support the current one */
+  bool result;
+  do {
+    result = mode_write(file, payload, header_len + count);
+  } while (!result && fall_back_mode(0));
+  uint64_t t_end = monotonic_ns();
 
   /* Close the I2C bus */
   close_i2c_bus(file);
+  charge_bus_time(t_end - t_locked, reg, count);
+
+  /* Record the transfer if we're tracing */
+  if (tracing)
+    record_transfer(trace_op, reg, count, data,
+                    result ? TRACE_OK : TRACE_EXFER, retry,
+                    t_start, t_locked, t_end);
 
   /* Return the result */
   return result;
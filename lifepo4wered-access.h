@@ -11,14 +11,103 @@
 #include <stdbool.h>
 
 
-/* Read LiFePO4wered/Pi data */
+/* I2C transfer modes, from fastest to most compatible */
 
-bool read_lifepo4wered_data(uint8_t reg, uint8_t count, uint8_t *data);
+enum eI2CMode {
+  I2C_MODE_AUTO,          /* Select the fastest mode the adapter supports */
+  I2C_MODE_RDWR_BLOCK,    /* Whole block in one combined I2C_RDWR message */
+  I2C_MODE_RDWR_CHUNKED,  /* Block split into several messages of one
+                             I2C_RDWR transfer */
+  I2C_MODE_SMBUS_BLOCK,   /* SMBus I2C block transfers */
+  I2C_MODE_SMBUS_BYTE,    /* SMBus single register transfers */
+  I2C_MODE_COUNT
+};
 
-/* Write LiFePO4wered/Pi chip data */
+/* I2C transfer mode names */
+
+extern const char *lifepo4wered_i2c_mode_name[I2C_MODE_COUNT];
+
+/* Bus time priorities of reads */
+
+enum eBusPriority {
+  BUS_PRIORITY_LOW,       /* Refused when the bus time budget is used up */
+  BUS_PRIORITY_HIGH       /* Always goes through */
+};
+
+/* I2C bus occupancy statistics, shared by all users of the library */
+
+struct sLiFePO4weredBusStats {
+  uint32_t  budget;       /* Bus time budget (us per s), 0 if unlimited */
+  int64_t   tokens;       /* Bus time (us) left in the budget */
+  uint64_t  since;        /* Monotonic time (us) the statistics started */
+  uint64_t  busy;         /* Time (us) the bus was held for transfers */
+  uint64_t  transfers;    /* Number of transfers */
+  uint64_t  over_budget;  /* High priority transfers without budget left */
+  uint64_t  refused;      /* Low priority reads refused for lack of budget */
+  uint64_t  cached;       /* Refused reads served from the cache */
+};
+
+
+/* Open a persistent session that keeps the I2C bus open between
+ * transfers, instead of opening it for every transfer.  The bus is
+ * still locked for each transfer, so other users can access it. */
+
+bool open_lifepo4wered_session(void);
+
+/* Close the persistent session */
+
+void close_lifepo4wered_session(void);
+
+/* Get the I2C transfer mode in use, querying the adapter capabilities
+ * if that has not happened yet.  Returns I2C_MODE_AUTO if the bus can't
+ * be accessed. */
+
+enum eI2CMode get_lifepo4wered_i2c_mode(void);
+
+/* Force the I2C transfer mode, or return to automatic selection with
+ * I2C_MODE_AUTO.  Returns false if the adapter doesn't support the
+ * mode. */
+
+bool set_lifepo4wered_i2c_mode(enum eI2CMode mode);
+
+/* Get the bus occupancy statistics.  Returns false if the shared bus
+ * state is not available. */
+
+bool get_lifepo4wered_bus_stats(struct sLiFePO4weredBusStats *stats);
+
+/* Set the bus time budget (us per s) for all users of the library, 0
+ * for unlimited.  Returns false if the shared bus state is not
+ * available. */
+
+bool set_lifepo4wered_bus_budget(uint32_t budget);
+
+/* Raise the priority of all reads by this process, for instance on the
+ * shutdown path */
+
+void set_lifepo4wered_bus_priority(enum eBusPriority priority);
+
+/* Read LiFePO4wered/Pi data.  A low priority read fails with errno set
+ * to EDQUOT if the bus time budget is used up.  The retry number of the
+ * transfer within the caller's access is recorded in traces. */
+
+bool read_lifepo4wered_data(uint8_t reg, uint8_t count, uint8_t *data,
+                            enum eBusPriority priority, uint8_t retry);
+
+/* Write LiFePO4wered/Pi chip data, writes always go through */
 
 bool write_lifepo4wered_data(uint8_t reg, uint8_t count, uint8_t *data,
-                              bool unlock);
+                              bool unlock, uint8_t retry);
+
+/* Save validated register data in the cache shared by all users of the
+ * library */
+
+void cache_lifepo4wered_data(uint8_t reg, uint8_t count,
+                             const uint8_t *data);
+
+/* Get register data from the shared cache, if all of it is cached and
+ * recent enough.  Counts as a read served from the cache. */
+
+bool cached_lifepo4wered_data(uint8_t reg, uint8_t count, uint8_t *data);
 
 
 #endif
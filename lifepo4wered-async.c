@@ -0,0 +1,213 @@
+/*
+ * LiFePO4wered/Pi asynchronous access module
+ * Copyright (C) 2020 Patrick Van Oosterwijck
+ * Released under the GPL v2
+ */
+
+#define _DEFAULT_SOURCE
+#include <pthread.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include "lifepo4wered-async.h"
+#include "lifepo4wered-access.h"
+
+
+/* Request queue */
+
+struct sRequestQueue {
+  struct sLiFePO4weredRequest *head;
+  struct sLiFePO4weredRequest *tail;
+};
+
+/* Asynchronous access state */
+
+static struct {
+  bool                  open;
+  bool                  stop;
+  int                   event_fd;
+  pthread_t             thread;
+  pthread_mutex_t       lock;
+  pthread_cond_t        cond;
+  struct sRequestQueue  submitted;
+  struct sRequestQueue  completed;
+} async = {
+  .event_fd = -1,
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+  .cond = PTHREAD_COND_INITIALIZER,
+};
+
+
+/* Append a request to a queue */
+
+static void queue_push(struct sRequestQueue *q,
+                       struct sLiFePO4weredRequest *req) {
+  req->next = NULL;
+  if (q->tail) {
+    q->tail->next = req;
+  } else {
+    q->head = req;
+  }
+  q->tail = req;
+}
+
+/* Take the first request from a queue */
+
+static struct sLiFePO4weredRequest *queue_pop(struct sRequestQueue *q) {
+  struct sLiFePO4weredRequest *req = q->head;
+  if (req) {
+    q->head = req->next;
+    if (!q->head) q->tail = NULL;
+  }
+  return req;
+}
+
+/* Serve a run of read and snapshot requests.  A single snapshot read
+ * serves the whole run if it contains a snapshot, otherwise the
+ * variables read are validated together from one register block. */
+
+static void serve_reads(struct sRequestQueue *run) {
+  bool wanted[LFP_VAR_COUNT] = { false };
+  enum eLiFePO4weredVar vars[LFP_VAR_COUNT];
+  int32_t values[LFP_VAR_COUNT], var_values[LFP_VAR_COUNT];
+  bool snapshot = false;
+  uint8_t distinct = 0;
+  for (struct sLiFePO4weredRequest *req = run->head; req; req = req->next) {
+    if (req->op == LFP_ASYNC_SNAPSHOT) {
+      snapshot = true;
+    } else if (req->var < LFP_VAR_COUNT && !wanted[req->var]) {
+      wanted[req->var] = true;
+      vars[distinct++] = req->var;
+    }
+  }
+  if (snapshot) {
+    read_lifepo4wered_snapshot(values);
+  } else if (distinct > 0) {
+    read_lifepo4wered_vars(distinct, vars, var_values);
+    for (uint8_t i = 0; i < distinct; i++) {
+      values[vars[i]] = var_values[i];
+    }
+  }
+  for (struct sLiFePO4weredRequest *req = run->head; req; req = req->next) {
+    if (req->op == LFP_ASYNC_SNAPSHOT) {
+      for (int var = 0; var < LFP_VAR_COUNT; var++) {
+        req->values[var] = values[var];
+      }
+    } else {
+      req->value = req->var < LFP_VAR_COUNT ? values[req->var] : -1;
+    }
+  }
+}
+
+/* Move served requests to the completed queue and signal the eventfd */
+
+static void complete_requests(struct sRequestQueue *done) {
+  uint64_t count = 0;
+  pthread_mutex_lock(&async.lock);
+  struct sLiFePO4weredRequest *req;
+  while ((req = queue_pop(done))) {
+    queue_push(&async.completed, req);
+    count++;
+  }
+  pthread_mutex_unlock(&async.lock);
+  if (count && write(async.event_fd, &count, sizeof(count)) < 0) {
+    /* The counter can't overflow in practice, nothing to do */
+  }
+}
+
+/* I/O thread: serve batches of submitted requests in order, grouping
+ * the reads between writes */
+
+static void *io_thread(void *arg) {
+  pthread_mutex_lock(&async.lock);
+  for (;;) {
+    while (!async.submitted.head && !async.stop) {
+      pthread_cond_wait(&async.cond, &async.lock);
+    }
+    if (!async.submitted.head) break;
+    struct sRequestQueue batch = async.submitted;
+    async.submitted.head = async.submitted.tail = NULL;
+    pthread_mutex_unlock(&async.lock);
+
+    struct sRequestQueue run = { NULL, NULL };
+    struct sLiFePO4weredRequest *req;
+    while ((req = queue_pop(&batch))) {
+      if (req->op == LFP_ASYNC_WRITE) {
+        /* Serve the reads before the write first to keep ordering */
+        if (run.head) {
+          serve_reads(&run);
+          complete_requests(&run);
+        }
+        req->value = write_lifepo4wered(req->var, req->value);
+        queue_push(&run, req);
+        complete_requests(&run);
+      } else {
+        queue_push(&run, req);
+      }
+    }
+    if (run.head) {
+      serve_reads(&run);
+      complete_requests(&run);
+    }
+
+    pthread_mutex_lock(&async.lock);
+  }
+  pthread_mutex_unlock(&async.lock);
+  return NULL;
+}
+
+/* Start the I/O thread serving asynchronous requests */
+
+int lifepo4wered_async_open(void) {
+  if (async.open) return async.event_fd;
+  async.event_fd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+  if (async.event_fd < 0) return -1;
+  open_lifepo4wered_session();
+  async.stop = false;
+  if (pthread_create(&async.thread, NULL, io_thread, NULL) != 0) {
+    close_lifepo4wered_session();
+    close(async.event_fd);
+    async.event_fd = -1;
+    return -1;
+  }
+  async.open = true;
+  return async.event_fd;
+}
+
+/* Submit a request to be served by the I/O thread */
+
+bool lifepo4wered_async_submit(struct sLiFePO4weredRequest *req) {
+  if (!async.open || !req ||
+      (req->op == LFP_ASYNC_SNAPSHOT && !req->values))
+    return false;
+  pthread_mutex_lock(&async.lock);
+  queue_push(&async.submitted, req);
+  pthread_cond_signal(&async.cond);
+  pthread_mutex_unlock(&async.lock);
+  return true;
+}
+
+/* Get the next completed request */
+
+struct sLiFePO4weredRequest *lifepo4wered_async_complete(void) {
+  pthread_mutex_lock(&async.lock);
+  struct sLiFePO4weredRequest *req = queue_pop(&async.completed);
+  pthread_mutex_unlock(&async.lock);
+  return req;
+}
+
+/* Stop the I/O thread and close the eventfd */
+
+void lifepo4wered_async_close(void) {
+  if (!async.open) return;
+  pthread_mutex_lock(&async.lock);
+  async.stop = true;
+  pthread_cond_signal(&async.cond);
+  pthread_mutex_unlock(&async.lock);
+  pthread_join(async.thread, NULL);
+  async.completed.head = async.completed.tail = NULL;
+  close_lifepo4wered_session();
+  close(async.event_fd);
+  async.event_fd = -1;
+  async.open = false;
+}
@@ -0,0 +1,61 @@
+/*
+ * LiFePO4wered/Pi asynchronous access module
+ * Copyright (C) 2020 Patrick Van Oosterwijck
+ * Released under the GPL v2
+ */
+
+#ifndef LIFEPO4WERED_ASYNC_H
+#define LIFEPO4WERED_ASYNC_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "lifepo4wered-data.h"
+
+
+/* Asynchronous request operations */
+
+enum eLiFePO4weredAsyncOp {
+  LFP_ASYNC_READ,
+  LFP_ASYNC_WRITE,
+  LFP_ASYNC_SNAPSHOT
+};
+
+/* Asynchronous request.  The caller owns the memory, which must stay
+ * valid until the request has been returned by
+ * lifepo4wered_async_complete(). */
+
+struct sLiFePO4weredRequest {
+  enum eLiFePO4weredAsyncOp   op;
+  enum eLiFePO4weredVar       var;        /* Variable to read or write */
+  int32_t                     value;      /* Value to write, and result of
+                                             a read or write on completion */
+  int32_t                     *values;    /* Snapshot results, must have
+                                             room for LFP_VAR_COUNT values */
+  void                        *user_data; /* For use by the caller */
+  struct sLiFePO4weredRequest *next;      /* Internal queue link */
+};
+
+
+/* Start the I/O thread serving asynchronous requests.  Returns an
+ * eventfd that becomes readable when requests have completed, or -1 on
+ * failure.  The synchronous API must not be used while the asynchronous
+ * API is open. */
+
+int lifepo4wered_async_open(void);
+
+/* Submit a request to be served by the I/O thread */
+
+bool lifepo4wered_async_submit(struct sLiFePO4weredRequest *req);
+
+/* Get the next completed request, or NULL if there is none.  Call this
+ * until it returns NULL after the eventfd becomes readable. */
+
+struct sLiFePO4weredRequest *lifepo4wered_async_complete(void);
+
+/* Serve the requests still queued, stop the I/O thread and close the
+ * eventfd.  Completed requests that were not retrieved are dropped. */
+
+void lifepo4wered_async_close(void);
+
+
+#endif
@@ -4,11 +4,15 @@
  * Released under the GPL v2
  */
 
+#define _DEFAULT_SOURCE
 #include <stdio.h>
 #include <ctype.h>
+#include <errno.h>
 #include <string.h>
 #include <stdlib.h>
+#include <time.h>
 #include "lifepo4wered-data.h"
+#include "lifepo4wered-access.h"
 
 
 /* Read or write operation */
@@ -16,7 +20,11 @@
 enum eOperation {
   OP_INVALID,
   OP_READ,
-  OP_WRITE
+  OP_WRITE,
+  OP_MEASURE,
+  OP_CALIBRATE,
+  OP_BENCH,
+  OP_BUS
 };
 
 /* Decimal or hexadecimal data */
@@ -32,6 +40,14 @@ enum eDataFormat {
 
 #define LFP_VAR_UNSPECIFIED     (LFP_VAR_INVALID + 1)
 
+/* Default number of samples for measurements */
+
+#define MEASURE_SAMPLES         32
+
+/* Default number of snapshots per transfer mode for benchmarks */
+
+#define BENCH_SAMPLES           50
+
 /* Print help */
 
 void print_help(char *name, char *error, uint8_t access_mask) {
@@ -43,7 +59,19 @@ void print_help(char *name, char *error, uint8_t access_mask) {
     printf("Available operations:\n");
     printf("READ or GET: get variable and print it in decimal\n");
     printf("READHEX, GETHEX or HEX: get variable and print it in hexadecimal\n");
-    printf("WRITE, SET or PUT: set the variable to the provided value\n\n");
+    printf("WRITE, SET or PUT: set the variable to the provided value\n");
+    printf("MEASURE: oversample the variable and print statistics, "
+           "optionally specify\n  the number of samples (default %d)\n",
+           MEASURE_SAMPLES);
+    printf("CALIBRATE: adjust the offset of VIN, VBAT, VOUT or IOUT so "
+           "the measurement\n  matches the provided reference value, "
+           "optionally followed by the number\n  of samples\n");
+    printf("BENCH: compare the I2C transfer modes supported by the adapter, "
+           "optionally\n  specify the number of snapshots per mode "
+           "(default %d)\n", BENCH_SAMPLES);
+    printf("BUS: print the I2C bus occupancy statistics shared by all "
+           "users, optionally\n  set the bus time budget in us per "
+           "second first (0 is unlimited)\n\n");
     printf("Available variables:\n");
   } else if (access_mask & ACCESS_READ) {
     printf("Available variables for READ:\n");
@@ -83,6 +111,10 @@ enum eOperation get_operation(char *op, enum eDataFormat *fmt) {
     { "WRITE",    OP_WRITE, DF_DATA },
     { "SET",      OP_WRITE, DF_DATA },
     { "PUT",      OP_WRITE, DF_DATA },
+    { "MEASURE",  OP_MEASURE,   DF_DEC  },
+    { "CALIBRATE",OP_CALIBRATE, DF_DEC  },
+    { "BENCH",    OP_BENCH,     DF_DEC  },
+    { "BUS",      OP_BUS,       DF_DEC  },
   };
   capitalize(op);
   for (int i=0; i<sizeof(op_table)/sizeof(struct sOpRef); i++) {
@@ -107,6 +139,89 @@ enum eLiFePO4weredVar get_variable(char *var) {
   return LFP_VAR_INVALID;
 }
 
+/* Get the monotonic time in us */
+
+uint64_t monotonic_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Time snapshot reads in every transfer mode the adapter supports */
+
+int bench_i2c_modes(int samples) {
+  enum eI2CMode selected = get_lifepo4wered_i2c_mode();
+  if (selected == I2C_MODE_AUTO) {
+    fprintf(stderr, "ERROR: Can't access the I2C bus\n");
+    return 6;
+  }
+  int32_t values[LFP_VAR_COUNT];
+  open_lifepo4wered_session();
+  /* Time actual bus reads: high priority reads are never refused for
+   * lack of bus time budget, so they are not served from the cache */
+  set_lifepo4wered_bus_priority(BUS_PRIORITY_HIGH);
+  int32_t readable = 0;
+  for (int var = 0; var < LFP_VAR_COUNT; var++) {
+    if (access_lifepo4wered((enum eLiFePO4weredVar)var, ACCESS_READ))
+      readable++;
+  }
+  printf("%-14s %10s %8s %8s %7s\n", "MODE", "SNAPSHOT/S", "AVG_US",
+         "MAX_US", "ERRORS");
+  for (enum eI2CMode mode = I2C_MODE_RDWR_BLOCK; mode < I2C_MODE_COUNT;
+       mode++) {
+    if (!set_lifepo4wered_i2c_mode(mode)) {
+      printf("%-14s %10s\n", lifepo4wered_i2c_mode_name[mode],
+             "unsupported");
+      continue;
+    }
+    uint64_t total = 0, max = 0;
+    int errors = 0;
+    for (int i = 0; i < samples; i++) {
+      uint64_t start = monotonic_us();
+      if (read_lifepo4wered_snapshot(values) < readable)
+        errors++;
+      uint64_t elapsed = monotonic_us() - start;
+      total += elapsed;
+      if (elapsed > max) max = elapsed;
+    }
+    printf("%-14s %10.1f %8llu %8llu %7d\n", lifepo4wered_i2c_mode_name[mode],
+           total ? samples * 1e6 / total : 0.0,
+           (unsigned long long)(total / samples), (unsigned long long)max,
+           errors);
+  }
+  /* Let automatic selection settle on a mode that works for snapshots */
+  set_lifepo4wered_i2c_mode(I2C_MODE_AUTO);
+  read_lifepo4wered_snapshot(values);
+  printf("Selected mode: %s\n",
+         lifepo4wered_i2c_mode_name[get_lifepo4wered_i2c_mode()]);
+  set_lifepo4wered_bus_priority(BUS_PRIORITY_LOW);
+  close_lifepo4wered_session();
+  return 0;
+}
+
+/* Print the I2C bus occupancy statistics */
+
+int print_bus_stats(void) {
+  struct sLiFePO4weredBusStats stats;
+  if (!get_lifepo4wered_bus_stats(&stats)) {
+    fprintf(stderr, "ERROR: Can't access the shared bus state\n");
+    return 6;
+  }
+  uint64_t elapsed = monotonic_us() - stats.since;
+  printf("BUS_BUDGET = %u\n", stats.budget);
+  printf("BUS_TOKENS = %lld\n", (long long)stats.tokens);
+  printf("BUS_OCCUPANCY = %.3f\n",
+         elapsed ? stats.busy * 100.0 / elapsed : 0.0);
+  printf("BUS_BUSY_US = %llu\n", (unsigned long long)stats.busy);
+  printf("BUS_ELAPSED_US = %llu\n", (unsigned long long)elapsed);
+  printf("BUS_TRANSFERS = %llu\n", (unsigned long long)stats.transfers);
+  printf("BUS_OVER_BUDGET = %llu\n",
+         (unsigned long long)stats.over_budget);
+  printf("BUS_REFUSED = %llu\n", (unsigned long long)stats.refused);
+  printf("BUS_CACHED = %llu\n", (unsigned long long)stats.cached);
+  return 0;
+}
+
 /* Program entry point */
 
 int main(int argc, char *argv[]) {
@@ -127,12 +242,35 @@ int main(int argc, char *argv[]) {
     return 2;
   }
 
+  if (op == OP_BENCH) {
+    int samples = argc > 2 ? strtol(argv[2], NULL, 0) : BENCH_SAMPLES;
+    if (samples < 1) {
+      print_help(argv[0], "Invalid number of samples", 0);
+      return 5;
+    }
+    return bench_i2c_modes(samples);
+  }
+
+  if (op == OP_BUS) {
+    if (argc > 2) {
+      char *end;
+      long budget = strtol(argv[2], &end, 0);
+      if (*end || budget < 0 || budget > 1000000) {
+        print_help(argv[0], "Invalid bus time budget", 0);
+        return 5;
+      }
+      set_lifepo4wered_bus_budget(budget);
+    }
+    return print_bus_stats();
+  }
+
   uint8_t access_mask = (op == OP_WRITE ? ACCESS_WRITE : 0) |
-                        (op == OP_READ ? ACCESS_READ : 0);
+                        (op == OP_READ || op == OP_MEASURE ||
+                         op == OP_CALIBRATE ? ACCESS_READ : 0);
 
   if (argc < 3) {
     var = LFP_VAR_UNSPECIFIED;
-    if (op == OP_WRITE) {
+    if (op != OP_READ) {
       print_help(argv[0], "No variable specified", access_mask);
       return 3;
     }
@@ -150,6 +288,11 @@ int main(int argc, char *argv[]) {
     return 5;
   }
 
+  if (op == OP_CALIBRATE && argc < 4) {
+    print_help(argv[0], "No reference value specified", 0);
+    return 5;
+  }
+
   if (op == OP_READ) {
     if (var != LFP_VAR_UNSPECIFIED) {
       value = read_lifepo4wered(var);
@@ -178,5 +321,42 @@ int main(int argc, char *argv[]) {
     printf("%d\n", value);
   }
 
+  if (op == OP_MEASURE || op == OP_CALIBRATE) {
+    struct sLiFePO4weredStats stats;
+    int samples_arg = op == OP_MEASURE ? 3 : 4;
+    int samples = argc > samples_arg ? strtol(argv[samples_arg], NULL, 0)
+                                      : MEASURE_SAMPLES;
+    if (samples < 1 || samples > UINT16_MAX) {
+      print_help(argv[0], "Invalid number of samples", 0);
+      return 5;
+    }
+    /* Keep the bus open for all the samples */
+    open_lifepo4wered_session();
+    bool ok;
+    errno = 0;
+    if (op == OP_MEASURE) {
+      ok = measure_lifepo4wered(1, &var, samples, &stats);
+    } else {
+      ok = calibrate_lifepo4wered(var, strtod(argv[3], NULL), samples,
+                                  &stats);
+    }
+    close_lifepo4wered_session();
+    if (!ok && op == OP_CALIBRATE && errno == ERANGE) {
+      fprintf(stderr, "ERROR: Reference needs an offset out of range\n");
+      return 6;
+    }
+    if (!ok) {
+      printf("%d\n", -2);
+      return 6;
+    }
+    if (op == OP_CALIBRATE) {
+      enum eLiFePO4weredVar offset_var = offset_lifepo4wered(var);
+      printf("%s = %d\n", lifepo4wered_var_name[offset_var],
+             read_lifepo4wered(offset_var));
+    }
+    printf("%.2f +/- %.2f (min %.2f, max %.2f, %u samples)\n",
+           stats.mean, stats.stddev, stats.min, stats.max, stats.samples);
+  }
+
   return value == -1 || value == -2 ? 6 : 0;
 }
@@ -11,14 +11,27 @@
 
 #include <unistd.h>
 #include <signal.h>
+#include <errno.h>
+#include <dirent.h>
+#include <limits.h>
 #include <string.h>
 #include <syslog.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 #include "lifepo4wered-data.h"
+#include "lifepo4wered-access.h"
+
+#ifdef BALENA
+#include <netdb.h>
+#include <poll.h>
+#include <sys/socket.h>
+#endif
 
 #ifdef SYSTEMD
+#include <systemd/sd-bus.h>
 #include <systemd/sd-daemon.h>
 #endif
 
@@ -30,10 +43,106 @@
 
 #define RTC_CHECK_DELAY 50000000
 
+/* Limits (ms) of the adaptive PI_RUNNING poll interval */
+
+#define POLL_INTERVAL_MIN       250
+#define POLL_INTERVAL_DEFAULT   1000
+#define POLL_INTERVAL_MAX       5000
+
+/* Battery headroom (mV) above VBAT_SHDN at which polling is at its
+ * fastest (LOW) and at which it returns to the default rate (HIGH)
+ * while running from the battery */
+
+#define VBAT_HEADROOM_LOW       100
+#define VBAT_HEADROOM_HIGH      400
+
+/* Time (ms) to keep polling fast after touch button activity */
+
+#define TOUCH_HOLDOFF           10000
+
+/* Maximum time (ms) between reads of the configuration the power state
+ * is judged by (VIN_THRESHOLD, VBAT_SHDN) */
+
+#define CONFIG_CHECK_INTERVAL   30000
+
+/* Time limit (ms) for an in-process shutdown request, after which the
+ * shutdown command is run instead */
+
+#define SHUTDOWN_REQUEST_TIMEOUT  5000
+
+/* Directory with the executables to run before triggering a shutdown */
+
+#ifndef SHUTDOWN_HOOK_DIR
+#define SHUTDOWN_HOOK_DIR       "/etc/lifepo4wered/shutdown.d"
+#endif
+
+/* Shutdown hook limits: number of hooks, dependencies per hook, name
+ * length and header lines searched for dependencies */
+
+#define MAX_HOOKS               32
+#define MAX_HOOK_DEPS           8
+#define HOOK_NAME_MAX           64
+#define HOOK_HEADER_LINES       16
+
+/* Time (ms) reserved for the rest of the system shutdown after the
+ * hooks, and the hook time budget (ms) used without PI_SHDN_TO and at
+ * the minimum */
+
+#define SHUTDOWN_RESERVE        15000
+#define HOOK_BUDGET_DEFAULT     30000
+#define HOOK_BUDGET_MIN         2000
+
+/* Longest time (ms) between systemd watchdog pings while the hooks run,
+ * well within WatchdogSec */
+
+#define HOOK_WATCHDOG_INTERVAL  5000
+
 /* Running flag */
 
 volatile sig_atomic_t running;
 
+/* Poll statistics report request flag */
+
+volatile sig_atomic_t report_stats;
+
+/* Adaptive poll state */
+
+struct sPollState {
+  uint32_t  interval;         /* Current poll interval (ms) */
+  uint64_t  wakeups;          /* Number of poll wakeups since start */
+  uint64_t  config_time;      /* Time of last configuration read (ms) */
+  int32_t   vin_threshold;    /* VIN_THRESHOLD (mV), -1 if unknown */
+  int32_t   vbat_shdn;        /* VBAT_SHDN (mV), -1 if unknown */
+  uint64_t  last_touch;       /* Time of last touch activity (ms) */
+  bool      touched;          /* Touch activity was seen */
+  bool      on_battery;       /* Running from battery (no VIN) */
+  int32_t   vbat_headroom;    /* VBAT - VBAT_SHDN (mV), -1 if unknown */
+};
+
+struct sPollState poll_state = {
+  .interval = POLL_INTERVAL_DEFAULT,
+  .vin_threshold = -1,
+  .vbat_shdn = -1,
+  .vbat_headroom = -1,
+};
+
+/* Variables read on every poll, with a single block transfer */
+
+enum ePollVar {
+  POLL_PI_RUNNING,
+  POLL_TOUCH_STATE,
+  POLL_VIN,
+  POLL_VBAT,
+  POLL_VAR_COUNT
+};
+
+const enum eLiFePO4weredVar poll_vars[POLL_VAR_COUNT] = {
+  PI_RUNNING,
+  TOUCH_STATE,
+  VIN,
+  VBAT
+};
+
 /* Running in foreground flag */
 bool foreground = false;
 
@@ -53,6 +162,13 @@ void term_handler(int signum)
   running = 0;
 }
 
+/* USR1 signal handler */
+
+void usr1_handler(int signum)
+{
+  report_stats = 1;
+}
+
 /* Set up TERM signal handler */
 
 void set_term_handler(void) {
@@ -64,10 +180,340 @@ void set_term_handler(void) {
   sigaction(SIGTERM, &action, NULL);
 }
 
-/* Shut down the system */
+/* Set up USR1 signal handler, used to request a poll statistics report */
+
+void set_usr1_handler(void) {
+  struct sigaction action;
+
+  action.sa_handler = usr1_handler;
+  sigemptyset (&action.sa_mask);
+  action.sa_flags = 0;
+  sigaction(SIGUSR1, &action, NULL);
+}
+
+/* Get the monotonic time in ms */
+
+uint64_t monotonic_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Sleep for the specified number of ms, returns early when a signal
+ * is received */
+
+void sleep_ms(uint32_t ms) {
+  struct timespec ts;
+  ts.tv_sec = ms / 1000;
+  ts.tv_nsec = (ms % 1000) * 1000000L;
+  nanosleep(&ts, NULL);
+}
+
+/* Read the configuration the power state is judged by.  It rarely
+ * changes, so it is only read occasionally to pick up changes. */
+
+void update_power_config(struct sPollState *ps, uint64_t now) {
+  ps->config_time = now;
+  ps->vin_threshold = access_lifepo4wered(VIN_THRESHOLD, ACCESS_READ) ?
+                        read_lifepo4wered(VIN_THRESHOLD) : -1;
+  ps->vbat_shdn = read_lifepo4wered(VBAT_SHDN);
+}
+
+/* Update the power state (external power presence and battery headroom
+ * above the shutdown voltage) from the polled VIN and VBAT */
+
+void update_power_state(struct sPollState *ps, int32_t vin, int32_t vbat) {
+  /* VIN is not available on all register versions, in that case we
+   * treat the system as running from the battery to be safe */
+  ps->on_battery = vin < 0 || ps->vin_threshold < 0 ||
+                    vin < ps->vin_threshold;
+  if (vbat >= 0 && ps->vbat_shdn >= 0) {
+    ps->vbat_headroom = vbat > ps->vbat_shdn ? vbat - ps->vbat_shdn : 0;
+  } else {
+    ps->vbat_headroom = -1;
+  }
+}
+
+/* Determine the next poll interval from the power state and touch
+ * activity.  Polling backs off gradually while everything is stable on
+ * external power, and tightens immediately when the touch button is
+ * used or when the battery discharges towards VBAT_SHDN. */
+
+uint32_t next_poll_interval(struct sPollState *ps, uint64_t now) {
+  uint32_t target;
+  if (ps->touched && now - ps->last_touch < TOUCH_HOLDOFF) {
+    target = POLL_INTERVAL_MIN;
+  } else if (ps->vbat_headroom < 0) {
+    target = POLL_INTERVAL_DEFAULT;
+  } else if (ps->on_battery) {
+    if (ps->vbat_headroom <= VBAT_HEADROOM_LOW) {
+      target = POLL_INTERVAL_MIN;
+    } else if (ps->vbat_headroom >= VBAT_HEADROOM_HIGH) {
+      target = POLL_INTERVAL_DEFAULT;
+    } else {
+      target = POLL_INTERVAL_MIN + (POLL_INTERVAL_DEFAULT - POLL_INTERVAL_MIN)
+                * (ps->vbat_headroom - VBAT_HEADROOM_LOW)
+                / (VBAT_HEADROOM_HIGH - VBAT_HEADROOM_LOW);
+    }
+  } else {
+    target = POLL_INTERVAL_MAX;
+  }
+  /* Tighten immediately, back off by doubling */
+  if (target > ps->interval * 2) {
+    target = ps->interval * 2;
+  }
+  return target;
+}
+
+/* Log poll statistics */
+
+void log_poll_stats(struct sPollState *ps) {
+  log_info("Poll interval %u ms, %llu wakeups, %s, VBAT headroom %d mV",
+           ps->interval, (unsigned long long)ps->wakeups,
+           ps->on_battery ? "on battery" : "on external power",
+           ps->vbat_headroom);
+  struct sLiFePO4weredBusStats bs;
+  if (get_lifepo4wered_bus_stats(&bs)) {
+    uint64_t elapsed = monotonic_ms() * 1000 - bs.since;
+    log_info("I2C bus %.3f%% occupied, budget %u us/s, %llu transfers, "
+             "%llu over budget, %llu refused, %llu cached",
+             elapsed ? bs.busy * 100.0 / elapsed : 0.0, bs.budget,
+             (unsigned long long)bs.transfers,
+             (unsigned long long)bs.over_budget,
+             (unsigned long long)bs.refused, (unsigned long long)bs.cached);
+  }
+}
+
+#ifdef BALENA
+/* Shutdown request to the Balena supervisor, resolved and formatted at
+ * startup so nothing needs to be looked up or allocated at shutdown */
+
+struct sSupervisorRequest {
+  bool                    ready;
+  int                     sock;
+  struct sockaddr_storage addr;
+  socklen_t               addr_len;
+  char                    request[512];
+  size_t                  request_len;
+} supervisor = { .sock = -1 };
+
+/* Prepare the supervisor shutdown request from the environment.  Only
+ * plain "http://host[:port]" addresses are handled here, anything else
+ * is left to curl. */
+
+void prepare_shut_down(void) {
+  const char *address = getenv("BALENA_SUPERVISOR_ADDRESS");
+  const char *api_key = getenv("BALENA_SUPERVISOR_API_KEY");
+  if (!address || !api_key || strncmp(address, "http://", 7) != 0) {
+    log_info("No usable Balena supervisor address, shutdown will use curl");
+    return;
+  }
+  /* Split the authority into host and port */
+  const char *authority = address + 7;
+  size_t authority_len = strcspn(authority, "/");
+  char host[256];
+  const char *port = "80";
+  if (authority_len == 0 || authority_len >= sizeof(host))
+    return;
+  memcpy(host, authority, authority_len);
+  host[authority_len] = '\0';
+  char *colon = strrchr(host, ':');
+  if (colon && !strchr(colon, ']')) {
+    *colon = '\0';
+    port = colon + 1;
+  }
+  /* Strip the brackets of an IPv6 address */
+  char *name = host;
+  if (name[0] == '[') {
+    name++;
+    name[strcspn(name, "]")] = '\0';
+  }
+  /* Resolve the address and create the socket */
+  struct addrinfo hints = {
+    .ai_family = AF_UNSPEC,
+    .ai_socktype = SOCK_STREAM,
+    .ai_flags = AI_NUMERICSERV,
+  };
+  struct addrinfo *res;
+  int err = getaddrinfo(name, port, &hints, &res);
+  if (err) {
+    log_info("Can't resolve Balena supervisor address: %s",
+             gai_strerror(err));
+    return;
+  }
+  memcpy(&supervisor.addr, res->ai_addr, res->ai_addrlen);
+  supervisor.addr_len = res->ai_addrlen;
+  supervisor.sock = socket(res->ai_family,
+                           SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+  freeaddrinfo(res);
+  if (supervisor.sock < 0)
+    return;
+  /* Format the request */
+  int len = snprintf(supervisor.request, sizeof(supervisor.request),
+                     "POST /v1/shutdown?apikey=%s HTTP/1.1\r\n"
+                     "Host: %.*s\r\n"
+                     "Content-Length: 0\r\n"
+                     "Connection: close\r\n\r\n",
+                     api_key, (int)authority_len, authority);
+  if (len < 0 || len >= (int)sizeof(supervisor.request)) {
+    close(supervisor.sock);
+    supervisor.sock = -1;
+    return;
+  }
+  supervisor.request_len = len;
+  supervisor.ready = true;
+}
+
+/* Wait until the socket is ready for the requested events or the
+ * deadline (monotonic ms) passes */
+
+bool wait_socket(int sock, short events, uint64_t deadline) {
+  struct pollfd pfd = { .fd = sock, .events = events };
+  for (;;) {
+    uint64_t now = monotonic_ms();
+    if (now >= deadline) {
+      errno = ETIMEDOUT;
+      return false;
+    }
+    int n = poll(&pfd, 1, deadline - now);
+    if (n > 0)
+      return true;
+    if (n < 0 && errno != EINTR)
+      return false;
+  }
+}
+
+/* Log a failed supervisor request */
+
+bool supervisor_failed(void) {
+  log_info("Balena supervisor request failed: %s", strerror(errno));
+  return false;
+}
+
+/* Send the prepared shutdown request to the Balena supervisor and check
+ * that it was accepted */
+
+bool request_shut_down(void) {
+  if (!supervisor.ready)
+    return false;
+  int sock = supervisor.sock;
+  uint64_t deadline = monotonic_ms() + SHUTDOWN_REQUEST_TIMEOUT;
+  /* Connect */
+  if (connect(sock, (struct sockaddr *)&supervisor.addr,
+              supervisor.addr_len) < 0) {
+    if (errno != EINPROGRESS || !wait_socket(sock, POLLOUT, deadline))
+      return supervisor_failed();
+    int err = 0;
+    socklen_t err_len = sizeof(err);
+    if (getsockopt(sock, SOL_SOCKET, SO_ERROR, &err, &err_len) < 0)
+      return supervisor_failed();
+    if (err) {
+      errno = err;
+      return supervisor_failed();
+    }
+  }
+  /* Send the request */
+  size_t sent = 0;
+  while (sent < supervisor.request_len) {
+    ssize_t n = send(sock, supervisor.request + sent,
+                     supervisor.request_len - sent, MSG_NOSIGNAL);
+    if (n > 0) {
+      sent += n;
+    } else if (n < 0 && errno != EAGAIN && errno != EINTR) {
+      return supervisor_failed();
+    } else if (!wait_socket(sock, POLLOUT, deadline)) {
+      return supervisor_failed();
+    }
+  }
+  /* Receive the status line: "HTTP/1.x NNN" */
+  char status[12];
+  size_t received = 0;
+  while (received < sizeof(status)) {
+    ssize_t n = recv(sock, status + received, sizeof(status) - received, 0);
+    if (n > 0) {
+      received += n;
+    } else if (n == 0 || (errno != EAGAIN && errno != EINTR)) {
+      return supervisor_failed();
+    } else if (!wait_socket(sock, POLLIN, deadline)) {
+      return supervisor_failed();
+    }
+  }
+  close(sock);
+  supervisor.sock = -1;
+  supervisor.ready = false;
+  if (strncmp(status, "HTTP/1.", 7) != 0 || status[9] != '2') {
+    log_info("Balena supervisor refused shutdown: status %.3s", status + 9);
+    return false;
+  }
+  log_info("Shutdown requested from Balena supervisor");
+  return true;
+}
+#elif defined SYSTEMD
+/* Power off request to systemd, with its bus connection opened and
+ * message built at startup */
+
+sd_bus *system_bus = NULL;
+sd_bus_message *poweroff_message = NULL;
+
+/* Connect to the system bus and build the request to start
+ * poweroff.target, as "systemctl poweroff" does */
+
+void prepare_shut_down(void) {
+  int err = sd_bus_open_system(&system_bus);
+  if (err >= 0) {
+    err = sd_bus_message_new_method_call(system_bus, &poweroff_message,
+                                         "org.freedesktop.systemd1",
+                                         "/org/freedesktop/systemd1",
+                                         "org.freedesktop.systemd1.Manager",
+                                         "StartUnit");
+  }
+  if (err >= 0) {
+    err = sd_bus_message_append(poweroff_message, "ss", "poweroff.target",
+                                "replace-irreversibly");
+  }
+  if (err < 0) {
+    log_info("Can't prepare D-Bus power off request: %s, "
+             "shutdown will use systemctl", strerror(-err));
+    poweroff_message = sd_bus_message_unref(poweroff_message);
+    system_bus = sd_bus_flush_close_unref(system_bus);
+  }
+}
+
+/* Send the prepared power off request to systemd */
+
+bool request_shut_down(void) {
+  if (!poweroff_message)
+    return false;
+  sd_bus_error error = SD_BUS_ERROR_NULL;
+  int err = sd_bus_call(system_bus, poweroff_message,
+                        SHUTDOWN_REQUEST_TIMEOUT * 1000ULL, &error, NULL);
+  if (err < 0) {
+    log_info("D-Bus power off request failed: %s",
+             error.message ? error.message : strerror(-err));
+    sd_bus_error_free(&error);
+    return false;
+  }
+  log_info("Power off requested from systemd");
+  return true;
+}
+#else
+/* Shutdown is left to init, nothing to prepare */
+
+void prepare_shut_down(void) {
+}
+
+bool request_shut_down(void) {
+  return false;
+}
+#endif
+
+/* Shut down the system, running the shutdown command if the in-process
+ * request fails */
 
 void shut_down(void) {
   log_info("Triggering system shutdown");
+  if (request_shut_down())
+    return;
 #ifdef BALENA
   char *params[4] = {"sh", "-c", "curl -X POST " \
     "\"$BALENA_SUPERVISOR_ADDRESS/v1/shutdown?" \
@@ -82,6 +528,277 @@ void shut_down(void) {
 #endif
 }
 
+/* Shutdown hook state */
+
+enum eHookState {
+  HOOK_PENDING,
+  HOOK_RUNNING,
+  HOOK_DONE,
+};
+
+struct sHook {
+  char            name[HOOK_NAME_MAX];
+  int             after[MAX_HOOK_DEPS]; /* Indices of hooks to wait for */
+  int             n_after;
+  enum eHookState state;
+  pid_t           pid;
+  uint64_t        start;                /* Start time (ms) */
+};
+
+struct sHook hooks[MAX_HOOKS];
+int n_hooks = 0;
+
+/* Hook directory and time budget (ms) for running the hooks, set at
+ * startup */
+
+const char *hook_dir = SHUTDOWN_HOOK_DIR;
+uint32_t hook_budget = HOOK_BUDGET_DEFAULT;
+
+/* Compare hooks by name for sorting */
+
+int compare_hooks(const void *a, const void *b) {
+  return strcmp(((const struct sHook *)a)->name,
+                ((const struct sHook *)b)->name);
+}
+
+/* Find a hook by name, returns -1 if not found */
+
+int find_hook(const char *name) {
+  for (int i = 0; i < n_hooks; i++) {
+    if (strcmp(hooks[i].name, name) == 0)
+      return i;
+  }
+  return -1;
+}
+
+/* Read the hooks a hook must wait for from its "# After:" header
+ * lines, within the first lines of the file */
+
+void read_hook_deps(struct sHook *hook) {
+  char path[PATH_MAX];
+  char line[256];
+  snprintf(path, sizeof(path), "%s/%s", hook_dir, hook->name);
+  FILE *f = fopen(path, "r");
+  if (!f)
+    return;
+  for (int n = 0; n < HOOK_HEADER_LINES && fgets(line, sizeof(line), f);
+       n++) {
+    if (strncmp(line, "# After:", 8) != 0)
+      continue;
+    char *save;
+    for (char *dep = strtok_r(line + 8, " \t\r\n", &save); dep;
+         dep = strtok_r(NULL, " \t\r\n", &save)) {
+      int index = find_hook(dep);
+      if (index < 0 || &hooks[index] == hook) {
+        log_info("Shutdown hook %s: ignoring unknown dependency %s",
+                 hook->name, dep);
+      } else if (hook->n_after < MAX_HOOK_DEPS) {
+        hook->after[hook->n_after++] = index;
+      }
+    }
+  }
+  fclose(f);
+}
+
+/* Find the executable shutdown hooks and work out the time available
+ * to run them.  This is done at startup so a shutdown doesn't depend on
+ * reading the device or the file system any more than necessary. */
+
+void prepare_shutdown_hooks(void) {
+  const char *env_dir = getenv("LIFEPO4WERED_HOOK_DIR");
+  if (env_dir)
+    hook_dir = env_dir;
+  DIR *dir = opendir(hook_dir);
+  if (!dir)
+    return;
+  struct dirent *entry;
+  while ((entry = readdir(dir)) && n_hooks < MAX_HOOKS) {
+    char path[PATH_MAX];
+    struct stat st;
+    if (entry->d_name[0] == '.' ||
+        strlen(entry->d_name) >= HOOK_NAME_MAX)
+      continue;
+    snprintf(path, sizeof(path), "%s/%s", hook_dir, entry->d_name);
+    if (stat(path, &st) < 0 || !S_ISREG(st.st_mode) ||
+        access(path, X_OK) < 0)
+      continue;
+    memset(&hooks[n_hooks], 0, sizeof(hooks[n_hooks]));
+    strcpy(hooks[n_hooks].name, entry->d_name);
+    n_hooks++;
+  }
+  closedir(dir);
+  if (!n_hooks)
+    return;
+  qsort(hooks, n_hooks, sizeof(hooks[0]), compare_hooks);
+  for (int i = 0; i < n_hooks; i++) {
+    read_hook_deps(&hooks[i]);
+  }
+
+  /* Power is cut PI_SHDN_TO after the device requests a shutdown if the
+   * system hasn't halted by then.  The hooks get what is left after
+   * reserving time for the rest of the system shutdown.  SHDN_DELAY
+   * only starts once the system has halted, so it adds nothing. */
+  int32_t shdn_to = access_lifepo4wered(PI_SHDN_TO, ACCESS_READ) ?
+                      read_lifepo4wered(PI_SHDN_TO) : -1;
+  int32_t shdn_delay = access_lifepo4wered(SHDN_DELAY, ACCESS_READ) ?
+                         read_lifepo4wered(SHDN_DELAY) : -1;
+  if (shdn_to > 0) {
+    int32_t budget = shdn_to * 1000 - SHUTDOWN_RESERVE;
+    hook_budget = budget > HOOK_BUDGET_MIN ? budget : HOOK_BUDGET_MIN;
+  }
+  log_info("%d shutdown hooks in %s, PI_SHDN_TO %d s, SHDN_DELAY %d, "
+           "%u ms budget", n_hooks, hook_dir, shdn_to, shdn_delay,
+           hook_budget);
+}
+
+/* Start a shutdown hook in its own process group, so stragglers can be
+ * killed along with their children */
+
+void start_hook(struct sHook *hook, const sigset_t *old_mask) {
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/%s", hook_dir, hook->name);
+  hook->start = monotonic_ms();
+  hook->state = HOOK_RUNNING;
+  hook->pid = fork();
+  if (hook->pid == 0) {
+    setpgid(0, 0);
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGUSR1, SIG_DFL);
+    sigprocmask(SIG_SETMASK, old_mask, NULL);
+    execl(path, hook->name, (char *)NULL);
+    _exit(127);
+  }
+  if (hook->pid < 0) {
+    log_info("Shutdown hook %s: can't start: %s", hook->name,
+             strerror(errno));
+    hook->state = HOOK_DONE;
+  } else {
+    setpgid(hook->pid, hook->pid);
+  }
+}
+
+/* Start the pending hooks whose dependencies are done, returns the
+ * number of hooks running */
+
+int start_ready_hooks(const sigset_t *old_mask, bool ignore_deps) {
+  int running_hooks = 0;
+  for (int i = 0; i < n_hooks; i++) {
+    struct sHook *hook = &hooks[i];
+    if (hook->state == HOOK_PENDING) {
+      bool ready = true;
+      for (int d = 0; d < hook->n_after && !ignore_deps; d++) {
+        ready = ready && hooks[hook->after[d]].state == HOOK_DONE;
+      }
+      if (ready)
+        start_hook(hook, old_mask);
+    }
+    if (hook->state == HOOK_RUNNING)
+      running_hooks++;
+  }
+  return running_hooks;
+}
+
+/* Reap finished hooks and log how long they took */
+
+void reap_hooks(void) {
+  pid_t pid;
+  int status;
+  while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+    for (int i = 0; i < n_hooks; i++) {
+      struct sHook *hook = &hooks[i];
+      if (hook->state != HOOK_RUNNING || hook->pid != pid)
+        continue;
+      hook->state = HOOK_DONE;
+      uint64_t duration = monotonic_ms() - hook->start;
+      if (WIFEXITED(status)) {
+        log_info("Shutdown hook %s: exit status %d after %llu ms",
+                 hook->name, WEXITSTATUS(status),
+                 (unsigned long long)duration);
+      } else {
+        log_info("Shutdown hook %s: signal %d after %llu ms", hook->name,
+                 WIFSIGNALED(status) ? WTERMSIG(status) : 0,
+                 (unsigned long long)duration);
+      }
+    }
+  }
+}
+
+/* Run the shutdown hooks concurrently, each as soon as the hooks it
+ * depends on are done, and kill whatever is still running when the
+ * budget runs out.  The device may have requested the shutdown up to
+ * "elapsed" ms ago, which is taken off the budget. */
+
+void run_shutdown_hooks(uint32_t elapsed) {
+  if (!n_hooks)
+    return;
+  uint32_t budget = hook_budget > elapsed + HOOK_BUDGET_MIN ?
+                      hook_budget - elapsed : HOOK_BUDGET_MIN;
+  uint64_t start = monotonic_ms();
+  uint64_t deadline = start + budget;
+  log_info("Running %d shutdown hooks, %u ms budget", n_hooks, budget);
+#ifdef SYSTEMD
+  /* STOPPING=1 started the stop timeout, which may be shorter than the
+   * hooks and the rest of the shutdown take */
+  sd_notifyf(0, "EXTEND_TIMEOUT_USEC=%llu",
+             (unsigned long long)(budget + SHUTDOWN_RESERVE) * 1000);
+#endif
+
+  /* Block SIGCHLD to wait for it with a timeout */
+  sigset_t chld_mask, old_mask;
+  sigemptyset(&chld_mask);
+  sigaddset(&chld_mask, SIGCHLD);
+  sigprocmask(SIG_BLOCK, &chld_mask, &old_mask);
+
+  for (;;) {
+    reap_hooks();
+    if (!start_ready_hooks(&old_mask, false)) {
+      /* Nothing running but hooks still pending means the remaining
+       * dependencies are circular */
+      bool pending = false;
+      for (int i = 0; i < n_hooks; i++) {
+        pending = pending || hooks[i].state == HOOK_PENDING;
+      }
+      if (!pending)
+        break;
+      log_info("Circular shutdown hook dependencies, starting the rest");
+      if (!start_ready_hooks(&old_mask, true))
+        break;
+    }
+    uint64_t now = monotonic_ms();
+    if (now >= deadline)
+      break;
+    uint64_t wait = deadline - now;
+#ifdef SYSTEMD
+    /* Keep the watchdog fed while waiting for the hooks */
+    sd_notify(0, "WATCHDOG=1");
+    if (wait > HOOK_WATCHDOG_INTERVAL)
+      wait = HOOK_WATCHDOG_INTERVAL;
+#endif
+    struct timespec ts = {
+      .tv_sec = wait / 1000,
+      .tv_nsec = wait % 1000 * 1000000L,
+    };
+    sigtimedwait(&chld_mask, NULL, &ts);
+  }
+
+  /* Kill the stragglers and skip the hooks that didn't get to start */
+  for (int i = 0; i < n_hooks; i++) {
+    struct sHook *hook = &hooks[i];
+    if (hook->state == HOOK_RUNNING) {
+      kill(-hook->pid, SIGKILL);
+      hook->state = HOOK_DONE;
+      log_info("Shutdown hook %s: killed after %llu ms", hook->name,
+               (unsigned long long)(monotonic_ms() - hook->start));
+    } else if (hook->state == HOOK_PENDING) {
+      log_info("Shutdown hook %s: not started", hook->name);
+    }
+  }
+  reap_hooks();
+  sigprocmask(SIG_SETMASK, &old_mask, NULL);
+  log_info("Shutdown hooks done after %llu ms",
+           (unsigned long long)(monotonic_ms() - start));
+}
+
 /* If the LiFePO4wered module has RTC functionality and the current
  * system time is off more than the limit of time difference, set
  * the system time from the RTC */
@@ -91,17 +808,25 @@ void system_time_from_rtc(void) {
   if (!access_lifepo4wered(RTC_TIME, ACCESS_READ))
     return;
   /* Is the time different enough? */
-  if (abs(read_lifepo4wered(RTC_TIME) - (int32_t)time(NULL)) >= RTC_SET_DIFF) {
+  int32_t rtc_time = read_lifepo4wered(RTC_TIME);
+  if (rtc_time < 0)
+    return;
+  if (abs(rtc_time - (int32_t)time(NULL)) >= RTC_SET_DIFF) {
     /* Wait until the RTC time changes */
     struct timespec new_ts = {0};
     struct timespec ts;
     ts.tv_sec = 0;
     ts.tv_nsec = RTC_CHECK_DELAY;
     int32_t start_time = read_lifepo4wered(RTC_TIME);
+    if (start_time < 0)
+      return;
     do {
       nanosleep(&ts, NULL);
       new_ts.tv_sec = read_lifepo4wered(RTC_TIME);
     } while(new_ts.tv_sec == start_time);
+    /* Leave the clock alone if the RTC can't be read */
+    if (new_ts.tv_sec < 0)
+      return;
     /* Set the system time to the RTC time */
     clock_settime(CLOCK_REALTIME, &new_ts);
     /* Log message */
@@ -135,6 +860,7 @@ void system_time_to_rtc(void) {
 
 int main(int argc, char *argv[]) {
   bool trigger_shutdown = false;
+  enum eI2CMode i2c_mode = I2C_MODE_AUTO;
 
 #ifdef SYSTEMD
   sd_notify(0, "STATUS=Startup");
@@ -152,8 +878,17 @@ int main(int argc, char *argv[]) {
 
   log_info("LiFePO4wered daemon started");
 
-  /* Set handler for TERM signal */
+  /* The daemon's reads are what keeps the system safe, they never wait
+   * for bus time */
+  set_lifepo4wered_bus_priority(BUS_PRIORITY_HIGH);
+
+  /* Prepare the shutdown request and hooks while the system is healthy */
+  prepare_shut_down();
+  prepare_shutdown_hooks();
+
+  /* Set handler for TERM and USR1 signals */
   set_term_handler();
+  set_usr1_handler();
 
   /* Set LiFePO4wered/Pi running flag */
   write_lifepo4wered(PI_RUNNING, 1);
@@ -162,6 +897,9 @@ int main(int argc, char *argv[]) {
   /* If available and necessary, restore the system time from the RTC */
   system_time_from_rtc();
 
+  /* Get the power configuration */
+  update_power_config(&poll_state, monotonic_ms());
+
 #ifdef SYSTEMD
   sd_notify(0, "READY=1");
   sd_notify(0, "STATUS=Active");
@@ -171,26 +909,75 @@ int main(int argc, char *argv[]) {
    * to terminate (which might be because the LiFePO4wered/Pi
    * running flag is reset) */
   while (running) {
+    uint64_t now = monotonic_ms();
+    poll_state.wakeups++;
+
+    /* Read everything the poll needs in one go */
+    int32_t values[POLL_VAR_COUNT];
+    read_lifepo4wered_vars(POLL_VAR_COUNT, poll_vars, values);
+
     /* Start shutdown if the LiFePO4wered/Pi running flag is reset */
-    if (read_lifepo4wered(PI_RUNNING) == 0) {
+    if (values[POLL_PI_RUNNING] == 0) {
       log_info("Signal from LiFePO4wered module to shut down");
       trigger_shutdown = true;
       running = 0;
+      break;
+    }
+
+    /* Log the I2C transfer mode when it is selected or changes */
+    if (get_lifepo4wered_i2c_mode() != i2c_mode) {
+      i2c_mode = get_lifepo4wered_i2c_mode();
+      log_info("Using %s I2C transfers",
+               lifepo4wered_i2c_mode_name[i2c_mode]);
+    }
+
+    /* Touch activity may be the start of a shutdown request */
+    int32_t touch = values[POLL_TOUCH_STATE];
+    if (touch > 0 && (touch & TOUCH_MASK) != TOUCH_INACTIVE) {
+      poll_state.touched = true;
+      poll_state.last_touch = now;
     }
-    
+
+    /* Track the power state, picking up configuration changes now and
+     * then */
+    if (now - poll_state.config_time >= CONFIG_CHECK_INTERVAL) {
+      update_power_config(&poll_state, now);
+    }
+    update_power_state(&poll_state, values[POLL_VIN], values[POLL_VBAT]);
+
+    /* Adapt the poll interval */
+    uint32_t interval = next_poll_interval(&poll_state, now);
+    if (interval != poll_state.interval) {
+      poll_state.interval = interval;
+#ifdef SYSTEMD
+      sd_notifyf(0, "STATUS=Active, poll interval %u ms", interval);
+#endif
+    }
+
+    if (report_stats) {
+      report_stats = 0;
+      log_poll_stats(&poll_state);
+    }
+
     /* Sleep most of the time */
 
 #ifdef SYSTEMD
     sd_notify(0, "WATCHDOG=1");
 #endif
-    sleep(1);
+    sleep_ms(poll_state.interval);
   }
 
+  log_poll_stats(&poll_state);
+
 #ifdef SYSTEMD
   sd_notify(0, "STOPPING=1");
   sd_notify(0, "STATUS=Shutdown");
 #endif
 
+  /* Give the shutdown hooks their chance to flush and stop things */
+  if (trigger_shutdown)
+    run_shutdown_hooks(poll_state.interval);
+
   /* If available, save the system time to the RTC */
   system_time_to_rtc();
 
@@ -6,24 +6,19 @@
 
 #define _DEFAULT_SOURCE
 #include <endian.h>
+#include <errno.h>
+#include <math.h>
+#include <string.h>
 #include <unistd.h>
 #include "lifepo4wered-data.h"
 #include "lifepo4wered-access.h"
+#include "lifepo4wered-regs.h"
 
 
-/* Number of I2C register versions defined */
-
-#define I2C_REG_VER_COUNT     7
-
 /* Minimum I2C register version that requires write unlock */
 
 #define I2C_WRUNLOCK_REG_VER  5
 
-/* Constant to use when a register is not availabled in a particular
- * register version */
-
-#define R_NA                  0xFF
-
 /* I2C access retries */
 
 #define I2C_RETRIES           20
@@ -36,150 +31,64 @@
 
 #define I2C_RETRY_DELAY       500
 
-/* Generate strings for variable names */
-
-#define GENERATE_STRING(STRING) #STRING,
-
-const char *lifepo4wered_var_name[LFP_VAR_COUNT] = {
-  FOREACH_LIFEPO4WERED_VAR(GENERATE_STRING)
-};
+/* I2C identical reads requirement for each sample when oversampling */
 
+#define MEASURE_IDENTICAL_READS 2
 
-/* Structure to define variable scale factors */
+/* Maximum number of offset adjustment steps when calibrating */
 
-struct sVarScale {
-  int32_t       mul;
-  int32_t       div;
-};
+#define CALIBRATE_STEPS       3
 
-/* Structure to define variable read and write behavior */
+/* Largest ADC offset calibration may set, in raw units: about 5% of the
+ * 10-bit ADC full scale.  Needing more means the reference is wrong. */
 
-struct sVarDef {
-  uint8_t       reg[I2C_REG_VER_COUNT];
-  uint8_t       read_bytes;
-  uint8_t       write_bytes;
-  uint8_t       sign_extend;
-};
+#define CALIBRATE_MAX_OFFSET  51
 
-/* This table defines scaling for all I2C registers, for different
- * scaling variants */
-
-static const struct sVarScale var_scale[LFP_VAR_COUNT][3] = {
-  /* I2C_REG_VER      */  { {      1,      1 }, {      1,      1 }, {      1,      1 } },
-  /* I2C_ADDRESS      */  { {      1,      1 }, {      1,      1 }, {      1,      1 } },
-  /* LED_STATE        */  { {      1,      1 }, {      1,      1 }, {      1,      1 } },
-  /* TOUCH_STATE      */  { {      1,      1 }, {      1,      1 }, {      1,      1 } },
-  /* TOUCH_CAP_CYCLES */  { {      1,      1 }, {      1,      1 }, {      1,      1 } },
-  /* TOUCH_THRESHOLD  */  { {      1,      1 }, {      1,      1 }, {      1,      1 } },
-  /* TOUCH_HYSTERESIS */  { {      1,      1 }, {      1,      1 }, {      1,      1 } },
-  /* DCO_RSEL         */  { {      1,      1 }, {      1,      1 }, {      1,      1 } },
-  /* DCO_DCOMOD       */  { {      1,      1 }, {      1,      1 }, {      1,      1 } },
-  /* VIN              */  { { 966667, 102300 }, { 120833, 102300 }, { 317154, 102300 } },
-  /* VBAT             */  { {   5000,   1023 }, {    625,   1023 }, {    625,   1023 } },
-  /* VOUT             */  { { 554878, 102300 }, {  69360, 102300 }, {  65705, 102300 } },
-  /* IOUT             */  { { 581395, 102300 }, {  72674, 102300 }, {  72674, 102300 } },
-  /* VBAT_MIN         */  { {   5000,   1023 }, {    625,   1023 }, {    625,   1023 } },
-  /* VBAT_SHDN        */  { {   5000,   1023 }, {    625,   1023 }, {    625,   1023 } },
-  /* VBAT_BOOT        */  { {   5000,   1023 }, {    625,   1023 }, {    625,   1023 } },
-  /* VOUT_MAX         */  { { 554878, 102300 }, {  69360, 102300 }, {  65705, 102300 } },
-  /* VIN_THRESHOLD    */  { { 966667, 102300 }, { 120833, 102300 }, { 317154, 102300 } },
-  /* IOUT_SHDN_THRESH */  { { 581395, 102300 }, {  72674, 102300 }, {  72674, 102300 } },
-  /* VOFFSET_ADC      */  { {   5000,   1023 }, {   5000,   1023 }, {   5000,   1023 } },
-  /* VBAT_OFFSET      */  { {   5000,   1023 }, {   5000,   1023 }, {   5000,   1023 } },
-  /* VOUT_OFFSET      */  { { 554878, 102300 }, { 554878, 102300 }, { 525641, 102300 } },
-  /* VIN_OFFSET       */  { { 966667, 102300 }, { 966667, 102300 }, { 253723,  10230 } },
-  /* IOUT_OFFSET      */  { { 581395, 102300 }, { 581395, 102300 }, { 581395, 102300 } },
-  /* AUTO_BOOT        */  { {      1,      1 }, {      1,      1 }, {      1,      1 } },
-  /* WAKE_TIME        */  { {      1,      1 }, {      1,      1 }, {      1,      1 } },
-  /* SHDN_DELAY       */  { {      1,      1 }, {      1,      1 }, {      1,      1 } },
-  /* AUTO_SHDN_TIME   */  { {      1,      1 }, {      1,      1 }, {      1,      1 } },
-  /* PI_BOOT_TO       */  { {     10,      1 }, {     10,      1 }, {     10,      1 } },
-  /* PI_SHDN_TO       */  { {     10,      1 }, {     10,      1 }, {     10,      1 } },
-  /* RTC_TIME         */  { {      1,      1 }, {      1,      1 }, {      1,      1 } },
-  /* RTC_WAKE_TIME    */  { {      1,      1 }, {      1,      1 }, {      1,      1 } },
-  /* WATCHDOG_CFG     */  { {      1,      1 }, {      1,      1 }, {      1,      1 } },
-  /* WATCHDOG_GRACE   */  { {     10,      1 }, {     10,      1 }, {     10,      1 } },
-  /* WATCHDOG_TIMER   */  { {     10,      1 }, {     10,      1 }, {     10,      1 } },
-  /* PI_RUNNING       */  { {      1,      1 }, {      1,      1 }, {      1,      1 } },
-  /* CFG_WRITE        */  { {      1,      1 }, {      1,      1 }, {      1,      1 } },
-};
+/* Generate strings for variable names */
 
-/* This table covers I2C register scale variants used by each register
- * version */
+#define LFP_VAR(NAME, READ_BYTES, WRITE_BYTES, SIGN_EXTEND, SCALE, REGS) \
+  #NAME,
 
-static const uint8_t var_scale_variant[I2C_REG_VER_COUNT] = {
-  0, 0, 0, 0, 1, 1, 2
+const char *lifepo4wered_var_name[LFP_VAR_COUNT] = {
+#include "lifepo4wered-regs.def"
 };
 
-/* This table covers definitions of all I2C registers */
-
-static const struct sVarDef var_table[LFP_VAR_COUNT] = {
-  /* I2C_REG_VER      */  { { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 }, 1, 0, 0 },
-  /* I2C_ADDRESS      */  { { 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01 }, 1, 1, 0 },
-  /* LED_STATE        */  { { 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02 }, 1, 1, 0 },
-  /* TOUCH_STATE      */  { { 0x19, 0x1B, 0x1D, 0x23, 0x22, 0x28, 0x3A }, 1, 0, 0 },
-  /* TOUCH_CAP_CYCLES */  { { 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03 }, 1, 1, 0 },
-  /* TOUCH_THRESHOLD  */  { { 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04 }, 1, 1, 0 },
-  /* TOUCH_HYSTERESIS */  { { 0x05, 0x05, 0x05, 0x05, 0x05, 0x05, 0x05 }, 1, 1, 0 },
-  /* DCO_RSEL         */  { { 0x06, 0x06, 0x06, 0x06, 0x06, 0x06, 0x06 }, 1, 1, 0 },
-  /* DCO_DCOMOD       */  { { 0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07 }, 1, 1, 0 },
-  /* VIN              */  { { R_NA, R_NA, R_NA, 0x21, R_NA, 0x26, 0x36 }, 2, 0, 1 },
-  /* VBAT             */  { { 0x15, 0x17, 0x19, 0x1D, 0x1E, 0x22, 0x32 }, 2, 0, 1 },
-  /* VOUT             */  { { 0x17, 0x19, 0x1B, 0x1F, 0x20, 0x24, 0x34 }, 2, 0, 1 },
-  /* IOUT             */  { { R_NA, R_NA, R_NA, R_NA, R_NA, R_NA, 0x38 }, 2, 0, 1 },
-  /* VBAT_MIN         */  { { 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08 }, 2, 2, 1 },
-  /* VBAT_SHDN        */  { { 0x0A, 0x0A, 0x0A, 0x0A, 0x0A, 0x0A, 0x0A }, 2, 2, 1 },
-  /* VBAT_BOOT        */  { { 0x0C, 0x0C, 0x0C, 0x0C, 0x0C, 0x0C, 0x0C }, 2, 2, 1 },
-  /* VOUT_MAX         */  { { 0x0E, 0x0E, 0x0E, 0x0E, 0x0E, 0x0E, 0x0E }, 2, 2, 1 },
-  /* VIN_THRESHOLD    */  { { R_NA, R_NA, R_NA, 0x10, R_NA, 0x10, 0x10 }, 2, 2, 1 },
-  /* IOUT_SHDN_THRESH */  { { R_NA, R_NA, R_NA, R_NA, R_NA, R_NA, 0x1A }, 2, 2, 1 },
-  /* VOFFSET_ADC      */  { { R_NA, R_NA, 0x10, 0x12, 0x10, 0x12, R_NA }, 2, 2, 1 },
-  /* VBAT_OFFSET      */  { { R_NA, R_NA, R_NA, R_NA, R_NA, R_NA, 0x12 }, 2, 2, 1 },
-  /* VOUT_OFFSET      */  { { R_NA, R_NA, R_NA, R_NA, R_NA, R_NA, 0x14 }, 2, 2, 1 },
-  /* VIN_OFFSET       */  { { R_NA, R_NA, R_NA, R_NA, R_NA, R_NA, 0x16 }, 2, 2, 1 },
-  /* IOUT_OFFSET      */  { { R_NA, R_NA, R_NA, R_NA, R_NA, R_NA, 0x18 }, 2, 2, 1 },
-  /* AUTO_BOOT        */  { { 0x10, 0x12, 0x14, 0x18, 0x14, 0x18, 0x20 }, 1, 1, 0 },
-  /* WAKE_TIME        */  { { 0x12, 0x14, 0x16, 0x1A, 0x1A, 0x1E, 0x26 }, 2, 2, 0 },
-  /* SHDN_DELAY       */  { { R_NA, 0x10, 0x12, 0x14, 0x12, 0x14, 0x1C }, 2, 2, 0 },
-  /* AUTO_SHDN_TIME   */  { { R_NA, R_NA, R_NA, 0x16, R_NA, 0x16, 0x1E }, 2, 2, 0 },
-  /* PI_BOOT_TO       */  { { R_NA, R_NA, R_NA, R_NA, 0x15, 0x19, 0x21 }, 1, 1, 0 },
-  /* PI_SHDN_TO       */  { { R_NA, R_NA, R_NA, R_NA, 0x16, 0x1A, 0x22 }, 1, 1, 0 },
-  /* RTC_TIME         */  { { R_NA, R_NA, R_NA, R_NA, R_NA, R_NA, 0x28 }, 4, 4, 0 },
-  /* RTC_WAKE_TIME    */  { { R_NA, R_NA, R_NA, R_NA, R_NA, R_NA, 0x2C }, 4, 4, 0 },
-  /* WATCHDOG_CFG     */  { { R_NA, R_NA, R_NA, R_NA, 0x17, 0x1B, 0x23 }, 1, 1, 0 },
-  /* WATCHDOG_GRACE   */  { { R_NA, R_NA, R_NA, R_NA, 0x18, 0x1C, 0x24 }, 1, 1, 0 },
-  /* WATCHDOG_TIMER   */  { { R_NA, R_NA, R_NA, R_NA, 0x1C, 0x20, 0x30 }, 1, 1, 0 },
-  /* PI_RUNNING       */  { { 0x14, 0x16, 0x18, 0x1C, 0x1D, 0x21, 0x31 }, 1, 1, 0 },
-  /* CFG_WRITE        */  { { 0x11, 0x13, 0x15, 0x19, 0x19, 0x1D, 0x25 }, 1, 1, 0 },
-};
 
 /* I2C register version detected */
 
 static int32_t i2c_reg_ver = 0;
 
+/* Variable definitions for the detected register version, generated
+ * from the register map */
+
+static const struct sVarDesc *var_desc = NULL;
+
 
 /* Determine if the specified variable can be accessed in the specified
  * manner (read, write or both) and return a pointer to the variable
  * definition (internal function) */
 
 static bool can_access_lifepo4wered(enum eLiFePO4weredVar var,
-                    uint8_t access_mask, const struct sVarDef **vd) {
+                    uint8_t access_mask, const struct sVarDesc **vd) {
   /* Check if we have a I2C register version */
   if (i2c_reg_ver <= 0) {
     /* If not, read it */
     i2c_reg_ver = read_lifepo4wered(I2C_REG_VER);
+    /* And select the variable definitions for it */
+    if (i2c_reg_ver > 0 && i2c_reg_ver <= I2C_REG_VER_COUNT) {
+      var_desc = lifepo4wered_var_desc[i2c_reg_ver - 1];
+    }
   }
   /* Are the variable and I2C register version in defined range? */
-  if (var > I2C_REG_VER && var < LFP_VAR_COUNT &&
-      i2c_reg_ver > 0 && i2c_reg_ver <= I2C_REG_VER_COUNT) {
+  if (var > I2C_REG_VER && var < LFP_VAR_COUNT && var_desc) {
     /* Get a pointer to the variable definition */
-    const struct sVarDef *var_def = &var_table[var];
+    const struct sVarDesc *var_def = &var_desc[var];
     /* Save it to the provided pointer, if one is provided */
     if (vd) {
       *vd = var_def;
     }
     /* Is this variable defined for the register version? */
-    if (var_def->reg[i2c_reg_ver - 1] != R_NA) {
+    if (var_def->reg != R_NA) {
       /* Then check the access */
       return ((access_mask & ACCESS_READ) && var_def->read_bytes) ||
               ((access_mask & ACCESS_WRITE) && var_def->write_bytes);
@@ -200,6 +109,155 @@ bool access_lifepo4wered(enum eLiFePO4weredVar var, uint8_t access_mask) {
   }
 }
 
+/* Get the raw value of a variable from its register data */
+
+static int32_t raw_lifepo4wered(const struct sVarDesc *var_def,
+                                const uint8_t *data) {
+  union {
+    uint8_t   b[4];
+    int16_t   h[2];
+    int32_t   i;
+  } raw;
+  raw.i = 0;
+  memcpy(raw.b, data, var_def->read_bytes);
+  if (var_def->sign_extend) {
+    return (int16_t)le16toh(raw.h[0]);
+  }
+  return le32toh(raw.i);
+}
+
+/* Decode a raw variable value to its scaled value, with the fixed point
+ * multiplier from the generated tables instead of a divide */
+
+static int32_t decode_lifepo4wered(const struct sVarDesc *var_def,
+                                   int32_t raw) {
+  return ((int64_t)raw * var_def->mul + var_def->round) >> var_def->shift;
+}
+
+/* Encode a scaled value to its raw variable value, rounding to the
+ * nearest raw value with exact halves rounded up like the decoding, so
+ * a value that was read can be written back unchanged */
+
+static int32_t encode_lifepo4wered(const struct sVarDesc *var_def,
+                                   int32_t value) {
+  int64_t a = 2 * (int64_t)value * var_def->scale_div + var_def->scale_mul;
+  int64_t b = 2 * (int64_t)var_def->scale_mul;
+  int64_t q = a / b;
+  /* Divide rounding towards negative infinity */
+  return (a % b != 0 && (a < 0) != (b < 0)) ? q - 1 : q;
+}
+
+/* Determine if a variable's register data may be served from the shared
+ * cache when the bus time budget is used up.  Registers that change by
+ * themselves are useless when stale. */
+
+static bool cacheable_lifepo4wered(enum eLiFePO4weredVar var) {
+  switch (var) {
+    case TOUCH_STATE:
+    case RTC_TIME:
+    case WATCHDOG_TIMER:
+    case PI_RUNNING:
+      return false;
+    default:
+      return true;
+  }
+}
+
+/* Get the retry number of a transfer attempt for an access that needs
+ * the given number of transfers when clean, for tracing */
+
+static uint8_t retry_number(uint8_t attempt, uint8_t needed) {
+  return attempt >= needed ? attempt - needed + 1 : 0;
+}
+
+/* Read the raw values of the variables flagged in valid[] with block
+ * transfers that cover all of them.  The block is read repeatedly until
+ * each variable has had the specified number of identical reads, the
+ * same way read_lifepo4wered() validates reads of a single variable.
+ * On return, valid[] flags the variables that were read successfully.
+ * The variables must be readable with the current register version.
+ * If a layout is provided, it is used as the register block instead of
+ * determining one.  If low priority reads are refused because the bus
+ * time budget is used up and use_cache is set, variables are taken from
+ * the shared cache instead. */
+
+static void read_raw_block(bool valid[LFP_VAR_COUNT], uint8_t identical,
+                           int32_t raw[LFP_VAR_COUNT],
+                           const struct sBlockLayout *layout,
+                           enum eBusPriority priority, bool use_cache) {
+  bool pending[LFP_VAR_COUNT];
+  uint8_t match_tries[LFP_VAR_COUNT];
+  uint8_t block[256], match_block[256];
+  uint16_t first_reg = 0xFF, end_reg = 0;
+  int pending_count = 0;
+
+  /* Determine the register block that covers the variables */
+  for (int var = 0; var < LFP_VAR_COUNT; var++) {
+    pending[var] = valid[var];
+    valid[var] = false;
+    match_tries[var] = 0;
+    if (pending[var]) {
+      const struct sVarDesc *var_def = &var_desc[var];
+      if (!layout) {
+        if (var_def->reg < first_reg) first_reg = var_def->reg;
+        if (var_def->reg + var_def->read_bytes > end_reg)
+          end_reg = var_def->reg + var_def->read_bytes;
+      }
+      pending_count++;
+    }
+  }
+  if (layout) {
+    first_reg = layout->first_reg;
+    end_reg = layout->first_reg + layout->length;
+  }
+
+  /* Read the block until all variables are validated */
+  for (uint8_t retries = 0; retries < I2C_RETRIES && pending_count;
+        retries++) {
+    usleep(I2C_RETRY_DELAY);
+    if (!read_lifepo4wered_data(first_reg, end_reg - first_reg, block,
+                                priority, retry_number(retries, identical))) {
+      if (errno != EDQUOT || !use_cache)
+        continue;
+      /* Over budget, use what is cached */
+      for (int var = 0; var < LFP_VAR_COUNT; var++) {
+        const struct sVarDesc *var_def = &var_desc[var];
+        uint8_t data[4];
+        if (pending[var] && cacheable_lifepo4wered(var) &&
+            cached_lifepo4wered_data(var_def->reg,
+                                var_def->read_bytes, data)) {
+          raw[var] = raw_lifepo4wered(var_def, data);
+          valid[var] = true;
+          pending[var] = false;
+          pending_count--;
+        }
+      }
+      continue;
+    }
+    for (int var = 0; var < LFP_VAR_COUNT; var++) {
+      if (!pending[var]) continue;
+      const struct sVarDesc *var_def = &var_desc[var];
+      uint8_t offset = var_def->reg - first_reg;
+      if (!match_tries[var] || memcmp(&block[offset], &match_block[offset],
+                                      var_def->read_bytes) == 0) {
+        if (match_tries[var] >= identical - 1) {
+          raw[var] = raw_lifepo4wered(var_def, &block[offset]);
+          if (cacheable_lifepo4wered(var))
+            cache_lifepo4wered_data(var_def->reg, var_def->read_bytes,
+                                    &block[offset]);
+          valid[var] = true;
+          pending[var] = false;
+          pending_count--;
+        }
+        match_tries[var]++;
+      } else {
+        match_tries[var] = 0;
+      }
+    }
+    memcpy(match_block, block, end_reg - first_reg);
+  }
+}
+
 /* Read data from LiFePO4wered/Pi
  * Because the MSP430G micro I2C peripheral relies heavily on software
  * support, it seems not possible to make reads work 100% reliable at
@@ -209,43 +267,45 @@ bool access_lifepo4wered(enum eLiFePO4weredVar var, uint8_t access_mask) {
  * multi-byte values that change in the middle of a read, so shadow
  * buffering reads on the micro may not be needed anymore. */
 
-int32_t read_lifepo4wered(enum eLiFePO4weredVar var) {
-  const struct sVarDef *var_def;
+static int32_t read_var_lifepo4wered(enum eLiFePO4weredVar var,
+                                     enum eBusPriority priority) {
+  const struct sVarDesc *var_def;
   if (var == I2C_REG_VER ||
       can_access_lifepo4wered(var, ACCESS_READ, &var_def)) {
     uint8_t match_tries = 0;
     union {
       uint8_t   b[4];
-      int16_t	h[2];
       int32_t   i;
     } data, match_data;
     data.i = 0;
     match_data.i = 0;
-    uint8_t reg = var == I2C_REG_VER ?
-                  I2C_REG_VER : var_def->reg[i2c_reg_ver - 1];
+    uint8_t reg = var == I2C_REG_VER ? I2C_REG_VER : var_def->reg;
     uint8_t read_bytes = var == I2C_REG_VER ? 1 : var_def->read_bytes;
-    uint8_t sign_extend = var == I2C_REG_VER ? 0 : var_def->sign_extend;
     for (uint8_t retries = 0; retries < I2C_RETRIES; retries++) {
-      usleep(500);
-      if (read_lifepo4wered_data(reg, read_bytes, data.b)) {
+      usleep(I2C_RETRY_DELAY);
+      if (read_lifepo4wered_data(reg, read_bytes, data.b, priority,
+                        retry_number(retries, I2C_IDENTICAL_READS))) {
         if (!match_tries || data.i == match_data.i) {
           if (match_tries >= I2C_IDENTICAL_READS - 1) {
             if (var == I2C_REG_VER) {
               return le32toh(data.i);
             }
-            const struct sVarScale *scale =
-                    &var_scale[var][var_scale_variant[i2c_reg_ver - 1]];
-	    if (sign_extend) {
-              data.i = data.h[0];
-            }
-            return (le32toh(data.i) * scale->mul + scale->div / 2)
-                    / scale->div;
+            if (cacheable_lifepo4wered(var))
+              cache_lifepo4wered_data(reg, read_bytes, data.b);
+            return decode_lifepo4wered(var_def,
+                                       raw_lifepo4wered(var_def, data.b));
           }
           match_tries++;
         } else {
           match_tries = 0;
         }
         match_data.i = data.i;
+      } else if (errno == EDQUOT && var != I2C_REG_VER &&
+                 cacheable_lifepo4wered(var) &&
+                 cached_lifepo4wered_data(reg, read_bytes, data.b)) {
+        /* Over budget, use the cached value */
+        return decode_lifepo4wered(var_def,
+                                   raw_lifepo4wered(var_def, data.b));
       }
     }
     return -2;
@@ -253,24 +313,242 @@ int32_t read_lifepo4wered(enum eLiFePO4weredVar var) {
   return -1;
 }
 
+int32_t read_lifepo4wered(enum eLiFePO4weredVar var) {
+  /* The register version and running flag are needed to operate
+   * safely, everything else can wait for bus time */
+  return read_var_lifepo4wered(var, var == I2C_REG_VER || var == PI_RUNNING ?
+                                    BUS_PRIORITY_HIGH : BUS_PRIORITY_LOW);
+}
+
+/* Read all variables from LiFePO4wered/Pi in one batched bus pass */
+
+int32_t read_lifepo4wered_snapshot(int32_t values[LFP_VAR_COUNT]) {
+  bool readable[LFP_VAR_COUNT], valid[LFP_VAR_COUNT];
+  int32_t raw[LFP_VAR_COUNT];
+  int32_t read_count = 0;
+
+  /* Determine which variables can be read */
+  for (int var = 0; var < LFP_VAR_COUNT; var++) {
+    readable[var] = var != I2C_REG_VER &&
+                    can_access_lifepo4wered(var, ACCESS_READ, NULL);
+    valid[var] = readable[var];
+  }
+  /* Read them in one go, using the snapshot block of the register
+   * version */
+  if (var_desc)
+    read_raw_block(valid, I2C_IDENTICAL_READS, raw,
+                   &lifepo4wered_snapshot_layout[i2c_reg_ver - 1],
+                   BUS_PRIORITY_LOW, true);
+  for (int var = 0; var < LFP_VAR_COUNT; var++) {
+    if (var == I2C_REG_VER) {
+      values[var] = i2c_reg_ver > 0 ? i2c_reg_ver : -1;
+    } else if (valid[var]) {
+      values[var] = decode_lifepo4wered(&var_desc[var], raw[var]);
+    } else {
+      values[var] = readable[var] ? -2 : -1;
+    }
+    if (valid[var] || (var == I2C_REG_VER && i2c_reg_ver > 0))
+      read_count++;
+  }
+  return read_count;
+}
+
+/* Read the specified variables from LiFePO4wered/Pi with block
+ * transfers covering all of them.  Like single variable reads, the read
+ * is high priority if it includes the running flag. */
+
+int32_t read_lifepo4wered_vars(uint8_t count,
+                               const enum eLiFePO4weredVar *vars,
+                               int32_t *values) {
+  bool readable[LFP_VAR_COUNT] = { false }, valid[LFP_VAR_COUNT];
+  int32_t raw[LFP_VAR_COUNT];
+  int32_t read_count = 0;
+  enum eBusPriority priority = BUS_PRIORITY_LOW;
+
+  for (uint8_t i = 0; i < count; i++) {
+    /* This also detects the register version if that didn't happen yet */
+    if (can_access_lifepo4wered(vars[i], ACCESS_READ, NULL)) {
+      readable[vars[i]] = true;
+      if (vars[i] == PI_RUNNING)
+        priority = BUS_PRIORITY_HIGH;
+    }
+  }
+  memcpy(valid, readable, sizeof(valid));
+  if (var_desc)
+    read_raw_block(valid, I2C_IDENTICAL_READS, raw, NULL, priority, true);
+  for (uint8_t i = 0; i < count; i++) {
+    enum eLiFePO4weredVar var = vars[i];
+    if (var == I2C_REG_VER && i2c_reg_ver > 0) {
+      values[i] = i2c_reg_ver;
+      read_count++;
+    } else if (var < LFP_VAR_COUNT && valid[var]) {
+      values[i] = decode_lifepo4wered(&var_desc[var], raw[var]);
+      read_count++;
+    } else {
+      values[i] = var < LFP_VAR_COUNT && readable[var] ? -2 : -1;
+    }
+  }
+  return read_count;
+}
+
+/* Measure variables from LiFePO4wered/Pi by oversampling
+ * Samples are taken back to back with block reads covering all
+ * requested variables.  Because the ADC values change between samples,
+ * each sample only requires MEASURE_IDENTICAL_READS identical reads to
+ * reject corrupted reads.  Values are scaled without rounding to keep
+ * the extra resolution gained by averaging. */
+
+bool measure_lifepo4wered(uint8_t count, const enum eLiFePO4weredVar *vars,
+                          uint16_t samples,
+                          struct sLiFePO4weredStats *stats) {
+  bool wanted[LFP_VAR_COUNT] = { false };
+  int32_t raw[LFP_VAR_COUNT];
+
+  for (uint8_t i = 0; i < count; i++) {
+    if (vars[i] == I2C_REG_VER ||
+        !can_access_lifepo4wered(vars[i], ACCESS_READ, NULL))
+      return false;
+    wanted[vars[i]] = true;
+    /* Mean and stddev hold the sums while sampling */
+    stats[i].mean = stats[i].stddev = 0;
+    stats[i].samples = 0;
+  }
+  for (uint16_t n = 0; n < samples; n++) {
+    bool valid[LFP_VAR_COUNT];
+    memcpy(valid, wanted, sizeof(valid));
+    read_raw_block(valid, MEASURE_IDENTICAL_READS, raw, NULL,
+                   BUS_PRIORITY_LOW, false);
+    for (uint8_t i = 0; i < count; i++) {
+      if (!valid[vars[i]]) continue;
+      const struct sVarDesc *var_def = &var_desc[vars[i]];
+      double value = (double)raw[vars[i]] * var_def->scale_mul /
+                      var_def->scale_div;
+      struct sLiFePO4weredStats *st = &stats[i];
+      if (!st->samples || value < st->min) st->min = value;
+      if (!st->samples || value > st->max) st->max = value;
+      st->mean += value;
+      st->stddev += value * value;
+      st->samples++;
+    }
+  }
+  bool result = true;
+  for (uint8_t i = 0; i < count; i++) {
+    struct sLiFePO4weredStats *st = &stats[i];
+    if (!st->samples) {
+      result = false;
+      continue;
+    }
+    double mean = st->mean / st->samples;
+    double variance = st->stddev / st->samples - mean * mean;
+    st->mean = mean;
+    st->stddev = variance > 0 ? sqrt(variance) : 0;
+  }
+  return result;
+}
+
+/* Write a raw variable value to its register */
+
+static bool write_raw_lifepo4wered(const struct sVarDesc *var_def,
+                                   int32_t raw) {
+  union {
+    uint8_t   b[4];
+    int32_t   i;
+  } data;
+  data.i = htole32(raw);
+  for (uint8_t retries = 0; retries < I2C_RETRIES; retries++) {
+    if (write_lifepo4wered_data(var_def->reg, var_def->write_bytes, data.b,
+                                i2c_reg_ver >= I2C_WRUNLOCK_REG_VER,
+                                retries)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/* Get the offset variable used to calibrate a measurement */
+
+enum eLiFePO4weredVar offset_lifepo4wered(enum eLiFePO4weredVar var) {
+  switch (var) {
+    case VIN:   return VIN_OFFSET;
+    case VBAT:  return VBAT_OFFSET;
+    case VOUT:  return VOUT_OFFSET;
+    case IOUT:  return IOUT_OFFSET;
+    default:    return LFP_VAR_INVALID;
+  }
+}
+
+/* Calibrate the ADC offset of a measurement against a reference value
+ * The offset is adjusted in raw register units with secant steps, since
+ * the sign of its effect on the measurement is found by measuring.  The
+ * offset that gives the smallest error is left in place, and the
+ * measurement with it is returned in stats.  If the reference would need
+ * an offset out of range, that offset is not written and false is
+ * returned with errno set to ERANGE. */
+
+bool calibrate_lifepo4wered(enum eLiFePO4weredVar var, double reference,
+                            uint16_t samples,
+                            struct sLiFePO4weredStats *stats) {
+  enum eLiFePO4weredVar offset_var = offset_lifepo4wered(var);
+  if (offset_var == LFP_VAR_INVALID ||
+      !can_access_lifepo4wered(offset_var, ACCESS_WRITE, NULL))
+    return false;
+  const struct sVarDesc *offset_def = &var_desc[offset_var];
+  bool valid[LFP_VAR_COUNT] = { false };
+  int32_t raw[LFP_VAR_COUNT];
+  valid[offset_var] = true;
+  read_raw_block(valid, I2C_IDENTICAL_READS, raw, NULL, BUS_PRIORITY_LOW,
+                 false);
+  if (!valid[offset_var] || !measure_lifepo4wered(1, &var, samples, stats))
+    return false;
+  int32_t offset = raw[offset_var];
+  double error = stats->mean - reference;
+  int32_t best_offset = offset;
+  double best_error = error;
+  /* Initial guess: the offset is added to the measurement */
+  double gain = (double)offset_def->scale_mul / offset_def->scale_div;
+  int32_t max_offset = (1L << (offset_def->write_bytes * 8 - 1)) - 1;
+  if (max_offset > CALIBRATE_MAX_OFFSET) max_offset = CALIBRATE_MAX_OFFSET;
+  for (uint8_t step = 0; step < CALIBRATE_STEPS; step++) {
+    int32_t new_offset = offset - lround(error / gain);
+    if (new_offset > max_offset || new_offset < -max_offset) {
+      /* Leave the best offset so far in place and report the error */
+      if (offset != best_offset)
+        write_raw_lifepo4wered(offset_def, best_offset);
+      errno = ERANGE;
+      return false;
+    }
+    if (new_offset == offset ||
+        !write_raw_lifepo4wered(offset_def, new_offset) ||
+        !measure_lifepo4wered(1, &var, samples, stats))
+      break;
+    double new_error = stats->mean - reference;
+    gain = (new_error - error) / (new_offset - offset);
+    offset = new_offset;
+    error = new_error;
+    if (fabs(error) < fabs(best_error)) {
+      best_offset = offset;
+      best_error = error;
+    }
+    /* Give up if the offset has no effect on the measurement */
+    if (fabs(gain) < 0.01) break;
+  }
+  /* Make sure the best offset is the one left in place */
+  if (offset != best_offset) {
+    return write_raw_lifepo4wered(offset_def, best_offset) &&
+            measure_lifepo4wered(1, &var, samples, stats);
+  }
+  return true;
+}
+
 /* Write data to LiFePO4wered/Pi */
 
 int32_t write_lifepo4wered(enum eLiFePO4weredVar var, int32_t value) {
-  const struct sVarDef *var_def;
+  const struct sVarDesc *var_def;
   if (can_access_lifepo4wered(var, ACCESS_WRITE, &var_def) && i2c_reg_ver) {
-    union {
-      uint8_t   b[4];
-      int32_t   i;
-    } data;
-    const struct sVarScale *scale =
-          &var_scale[var][var_scale_variant[i2c_reg_ver - 1]];
-    data.i = htole32((value * scale->div + scale->mul / 2) / scale->mul);
-    for (uint8_t retries = 0; retries < I2C_RETRIES; retries++) {
-      if (write_lifepo4wered_data(var_def->reg[i2c_reg_ver - 1],
-                                  var_def->write_bytes, data.b,
-                                  i2c_reg_ver >= I2C_WRUNLOCK_REG_VER)) {
-        return read_lifepo4wered(var);
-      }
+    if (write_raw_lifepo4wered(var_def,
+                               encode_lifepo4wered(var_def, value))) {
+      /* Read back what was written, the write already took the bus */
+      return read_var_lifepo4wered(var, BUS_PRIORITY_HIGH);
     }
     return -2;
   }
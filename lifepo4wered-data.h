@@ -1,6 +1,6 @@
 /* 
  * LiFePO4wered/Pi data module
- * Copyright (C) 2015-2018 Patrick Van Oosterwijck
+ * Copyright (C) 2015-2020 Patrick Van Oosterwijck
  * Released under the GPL v2
  */
 
@@ -11,94 +11,39 @@
 #include <stdbool.h>
 
 
-/* Generate enumeration and corresponding strings of available
- * LiFePO4wered/Pi variables */
-
-#define FOREACH_LIFEPO4WERED_VAR(LIFEPO4WERED_VAR)  \
-  LIFEPO4WERED_VAR(I2C_REG_VER)                     \
-  LIFEPO4WERED_VAR(I2C_ADDRESS)                     \
-  LIFEPO4WERED_VAR(LED_STATE)                       \
-  LIFEPO4WERED_VAR(TOUCH_STATE)                     \
-  LIFEPO4WERED_VAR(TOUCH_CAP_CYCLES)                \
-  LIFEPO4WERED_VAR(TOUCH_THRESHOLD)                 \
-  LIFEPO4WERED_VAR(TOUCH_HYSTERESIS)                \
-  LIFEPO4WERED_VAR(DCO_RSEL)                        \
-  LIFEPO4WERED_VAR(DCO_DCOMOD)                      \
-  LIFEPO4WERED_VAR(VIN)                             \
-  LIFEPO4WERED_VAR(VBAT)                            \
-  LIFEPO4WERED_VAR(VOUT)                            \
-  LIFEPO4WERED_VAR(IOUT)                            \
-  LIFEPO4WERED_VAR(VBAT_MIN)                        \
-  LIFEPO4WERED_VAR(VBAT_SHDN)                       \
-  LIFEPO4WERED_VAR(VBAT_BOOT)                       \
-  LIFEPO4WERED_VAR(VOUT_MAX)                        \
-  LIFEPO4WERED_VAR(VIN_THRESHOLD)                   \
-  LIFEPO4WERED_VAR(IOUT_SHDN_THRESHOLD)             \
-  LIFEPO4WERED_VAR(VOFFSET_ADC)                     \
-  LIFEPO4WERED_VAR(VBAT_OFFSET)                     \
-  LIFEPO4WERED_VAR(VOUT_OFFSET)                     \
-  LIFEPO4WERED_VAR(VIN_OFFSET)                      \
-  LIFEPO4WERED_VAR(IOUT_OFFSET)                     \
-  LIFEPO4WERED_VAR(AUTO_BOOT)                       \
-  LIFEPO4WERED_VAR(WAKE_TIME)                       \
-  LIFEPO4WERED_VAR(SHDN_DELAY)                      \
-  LIFEPO4WERED_VAR(AUTO_SHDN_TIME)                  \
-  LIFEPO4WERED_VAR(PI_BOOT_TO)                      \
-  LIFEPO4WERED_VAR(PI_SHDN_TO)                      \
-  LIFEPO4WERED_VAR(RTC_TIME)                        \
-  LIFEPO4WERED_VAR(RTC_WAKE_TIME)                   \
-  LIFEPO4WERED_VAR(WATCHDOG_CFG)                    \
-  LIFEPO4WERED_VAR(WATCHDOG_GRACE)                  \
-  LIFEPO4WERED_VAR(WATCHDOG_TIMER)                  \
-  LIFEPO4WERED_VAR(PI_RUNNING)                      \
-  LIFEPO4WERED_VAR(CFG_WRITE)                       \
-
-#define GENERATE_ENUM(ENUM) ENUM,
+/* Enumeration of available LiFePO4wered/Pi variables, defined in the
+ * register map */
+
+#define LFP_VAR(NAME, READ_BYTES, WRITE_BYTES, SIGN_EXTEND, SCALE, REGS) \
+  NAME,
 
 enum eLiFePO4weredVar {
-  FOREACH_LIFEPO4WERED_VAR(GENERATE_ENUM)
+#include "lifepo4wered-regs.def"
   LFP_VAR_COUNT,
   LFP_VAR_INVALID = LFP_VAR_COUNT
 };
 
 extern const char *lifepo4wered_var_name[LFP_VAR_COUNT];
 
-/* Touch states and masks */
-
-#define TOUCH_INACTIVE          0x00
-#define TOUCH_START             0x03
-#define TOUCH_STOP              0x0C
-#define TOUCH_HELD              0x0F
-#define TOUCH_ACTIVE_MASK       0x03
-#define TOUCH_MASK              0x0F
-
-/* LED states when Pi on */
-
-#define LED_STATE_OFF           0x00
-#define LED_STATE_ON            0x01
-#define LED_STATE_PULSING       0x02
-#define LED_STATE_FLASHING      0x03
-
-/* Auto boot settings */
+/* Touch states and masks, LED states when Pi on, auto boot and watchdog
+ * settings, and register access masks, defined in the register map */
 
-#define AUTO_BOOT_OFF           0x00
-#define AUTO_BOOT_VBAT          0x01
-#define AUTO_BOOT_VBAT_SMART    0x02
-#define AUTO_BOOT_VIN           0x03
-#define AUTO_BOOT_VIN_SMART     0x04
-#define AUTO_BOOT_NO_VIN        0x05
-#define AUTO_BOOT_NO_VIN_SMART  0x06
+#define LFP_CONST(NAME, VALUE) NAME = VALUE,
 
-/* Watchdog settings */
+enum eLiFePO4weredConst {
+#include "lifepo4wered-regs.def"
+};
 
-#define WATCHDOG_OFF            0x00
-#define WATCHDOG_ALERT          0x01
-#define WATCHDOG_SHDN           0x02
 
-/* Register access masks */
+/* Measurement statistics */
 
-#define ACCESS_READ             0x01
-#define ACCESS_WRITE            0x02
+struct sLiFePO4weredStats {
+  double    mean;
+  double    stddev;
+  double    min;
+  double    max;
+  uint16_t  samples;          /* Number of valid samples */
+};
 
 
 /* Determine if the specified variable can be accessed in the specified
@@ -110,6 +55,49 @@ bool access_lifepo4wered(enum eLiFePO4weredVar var, uint8_t access_mask);
 
 int32_t read_lifepo4wered(enum eLiFePO4weredVar);
 
+/* Read all variables from LiFePO4wered/Pi in one batched bus pass.
+ * Variables that can't be read are set to -1, variables that could not
+ * be read reliably are set to -2.  Returns the number of variables that
+ * were read successfully. */
+
+int32_t read_lifepo4wered_snapshot(int32_t values[LFP_VAR_COUNT]);
+
+/* Read the specified variables from LiFePO4wered/Pi with block
+ * transfers covering all of them, validated the same way as
+ * read_lifepo4wered().  I2C_REG_VER is the version detected when the
+ * register tables were selected.  Variables that can't be read are set
+ * to -1, variables that could not be read reliably are set to -2.
+ * Returns the number of variables that were read successfully. */
+
+int32_t read_lifepo4wered_vars(uint8_t count,
+                               const enum eLiFePO4weredVar *vars,
+                               int32_t *values);
+
+/* Measure variables from LiFePO4wered/Pi by taking the specified number
+ * of samples back to back, and return statistics for each of them, with
+ * fractional resolution.  Returns false if a variable can't be read or
+ * no valid samples were taken. */
+
+bool measure_lifepo4wered(uint8_t count, const enum eLiFePO4weredVar *vars,
+                          uint16_t samples,
+                          struct sLiFePO4weredStats *stats);
+
+/* Get the offset variable used to calibrate a measurement, or
+ * LFP_VAR_INVALID if the variable has no offset */
+
+enum eLiFePO4weredVar offset_lifepo4wered(enum eLiFePO4weredVar var);
+
+/* Calibrate the ADC offset of a measurement (VIN, VBAT, VOUT or IOUT)
+ * against a reference value, by measuring with the specified number of
+ * samples and writing the corresponding offset register.  The resulting
+ * measurement is returned in stats.  The offset is not saved to flash.
+ * Fails with errno set to ERANGE if the reference is too far off to be
+ * reached with a sane offset. */
+
+bool calibrate_lifepo4wered(enum eLiFePO4weredVar var, double reference,
+                            uint16_t samples,
+                            struct sLiFePO4weredStats *stats);
+
 /* Write data to LiFePO4wered/Pi */
 
 int32_t write_lifepo4wered(enum eLiFePO4weredVar, int32_t value);
@@ -0,0 +1,542 @@
+/*
+ * LiFePO4wered/Pi I2C device emulator
+ * LD_PRELOAD shim that intercepts access to /dev/i2c-* and serves
+ * I2C_RDWR and SMBus transfers from an emulated LiFePO4wered/Pi+
+ * register file, with optional fault injection and adapter limitations,
+ * so the unmodified CLI, daemon and library can be exercised without
+ * hardware.
+ *
+ * Usage:
+ *   LD_PRELOAD=build/liblifepo4wered-emu.so build/lifepo4wered-cli get
+ *
+ * Environment:
+ *   LIFEPO4WERED_EMU_FILE    Register file shared between all emulated
+ *                            processes (default /tmp/lifepo4wered-emu)
+ *   LIFEPO4WERED_EMU_FAULTS  Comma separated fault probabilities, e.g.
+ *                            "nack=0.01,flip=0.05,tear=0.01,busy=0.01",
+ *                            and ADC noise amplitude in LSB, e.g. "noise=4"
+ *   LIFEPO4WERED_EMU_SEED    Random seed for reproducible fault sequences
+ *   LIFEPO4WERED_EMU_ADAPTER Emulated adapter: "i2c" (default), "i2c32"
+ *                            (reads limited to 32 bytes), "smbus" (SMBus
+ *                            I2C block transfers only), "byte" (SMBus
+ *                            byte and word transfers only) or "noword"
+ *                            (SMBus byte transfers, word reads and I2C
+ *                            block writes)
+ *
+ * Copyright (C) 2020 Patrick Van Oosterwijck
+ * Released under the GPL v2
+ */
+
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <linux/i2c-dev.h>
+#include <linux/i2c.h>
+
+
+/* Emulated device constants */
+
+#define EMU_I2C_ADDRESS     0x43
+#define EMU_I2C_WR_UNLOCK   0xC9
+#define EMU_REG_VER         7
+#define EMU_WRUNLOCK_VER    5
+#define EMU_REG_RTC_TIME    0x28
+#define EMU_REG_ADC_FIRST   0x32
+#define EMU_REG_ADC_LAST    0x38
+#define EMU_REG_OFFSET      0x12
+#define EMU_ADC_COUNT       4
+
+/* ADC counts per offset register LSB */
+
+#define EMU_OFFSET_GAIN     8
+
+/* ADC update period (ms), noise only changes this often */
+
+#define EMU_ADC_PERIOD      10
+
+/* Default register file location */
+
+#define EMU_DEFAULT_FILE    "/tmp/lifepo4wered-emu"
+
+/* Magic number to identify an initialized register file */
+
+#define EMU_MAGIC           0x4C465047
+
+/* Maximum number of messages in an I2C_RDWR transfer, as limited by the
+ * i2c-dev driver */
+
+#define EMU_RDWR_MAX_MSGS   42
+
+/* Maximum number of file descriptors we track */
+
+#define EMU_MAX_FDS         1024
+
+
+/* Register file shared between all processes using the emulator */
+
+struct sEmuState {
+  uint32_t  magic;
+  uint32_t  drift;
+  int64_t   rtc_offset;
+  int64_t   adc_update;               /* Time of last ADC update (ms) */
+  int16_t   adc_noise[EMU_ADC_COUNT]; /* Noise of last ADC update */
+  uint16_t  adc_base[EMU_ADC_COUNT];  /* ADC values without offset */
+  uint8_t   reg[256];
+};
+
+/* Fault probabilities */
+
+struct sEmuFaults {
+  double    nack;             /* Transfer not acknowledged */
+  double    flip;             /* First bit of a read comes out wrong */
+  double    tear;             /* ADC value changes in the middle of a read */
+  double    busy;             /* Bus locked by another process */
+  int       noise;            /* ADC noise amplitude (LSB) */
+};
+
+/* Emulated adapter */
+
+struct sEmuAdapter {
+  const char    *name;
+  unsigned long funcs;        /* Functionality reported by I2C_FUNCS */
+  uint16_t      max_read_len; /* I2C_RDWR read message limit, 0 if none */
+};
+
+static const struct sEmuAdapter emu_adapters[] = {
+  { "i2c",    I2C_FUNC_I2C | I2C_FUNC_SMBUS_EMUL, 0 },
+  { "i2c32",  I2C_FUNC_I2C | I2C_FUNC_SMBUS_EMUL, 32 },
+  { "smbus",  I2C_FUNC_SMBUS_BYTE_DATA | I2C_FUNC_SMBUS_WORD_DATA |
+              I2C_FUNC_SMBUS_I2C_BLOCK, 0 },
+  { "byte",   I2C_FUNC_SMBUS_BYTE_DATA | I2C_FUNC_SMBUS_WORD_DATA, 0 },
+  { "noword", I2C_FUNC_SMBUS_BYTE_DATA | I2C_FUNC_SMBUS_READ_WORD_DATA |
+              I2C_FUNC_SMBUS_WRITE_I2C_BLOCK, 0 },
+};
+
+/* Initial register values, matching a LiFePO4wered/Pi+ with register
+ * version 7 */
+
+struct sEmuInit {
+  uint8_t   reg;
+  uint8_t   bytes;
+  uint32_t  value;
+};
+
+static const struct sEmuInit emu_init[] = {
+  { 0x00, 1, EMU_REG_VER },       /* I2C_REG_VER */
+  { 0x01, 1, EMU_I2C_ADDRESS },   /* I2C_ADDRESS */
+  { 0x02, 1, 0x01 },              /* LED_STATE */
+  { 0x03, 1, 4 },                 /* TOUCH_CAP_CYCLES */
+  { 0x04, 1, 12 },                /* TOUCH_THRESHOLD */
+  { 0x05, 1, 2 },                 /* TOUCH_HYSTERESIS */
+  { 0x06, 1, 13 },                /* DCO_RSEL */
+  { 0x07, 1, 0x80 },              /* DCO_DCOMOD */
+  { 0x08, 2, 4665 },              /* VBAT_MIN: 2850 mV */
+  { 0x0A, 2, 4828 },              /* VBAT_SHDN: 2950 mV */
+  { 0x0C, 2, 5156 },              /* VBAT_BOOT: 3150 mV */
+  { 0x0E, 2, 5449 },              /* VOUT_MAX: 3500 mV */
+  { 0x10, 2, 1452 },              /* VIN_THRESHOLD: 4500 mV */
+  { 0x1C, 2, 65 },                /* SHDN_DELAY */
+  { 0x1E, 2, 0xFFFF },            /* AUTO_SHDN_TIME */
+  { 0x21, 1, 30 },                /* PI_BOOT_TO: 300 s */
+  { 0x22, 1, 12 },                /* PI_SHDN_TO: 120 s */
+  { 0x24, 1, 2 },                 /* WATCHDOG_GRACE: 20 s */
+  { 0x31, 1, 1 },                 /* PI_RUNNING */
+  { 0x32, 2, 5402 },              /* VBAT: 3300 mV */
+  { 0x34, 2, 7941 },              /* VOUT: 5100 mV */
+  { 0x36, 2, 1613 },              /* VIN: 5000 mV */
+  { 0x38, 2, 422 },               /* IOUT: 300 mA */
+};
+
+/* Emulator state */
+
+static struct sEmuState *emu_state;
+static struct sEmuFaults emu_faults;
+static const struct sEmuAdapter *emu_adapter = &emu_adapters[0];
+static unsigned int emu_seed;
+static uint8_t emu_fds[EMU_MAX_FDS];
+static uint16_t emu_slave[EMU_MAX_FDS];
+
+/* Real libc functions */
+
+static int (*real_open)(const char *, int, ...);
+static int (*real_open64)(const char *, int, ...);
+static int (*real_close)(int);
+static int (*real_flock)(int, int);
+static int (*real_ioctl)(int, unsigned long, ...);
+
+
+/* Parse the fault probabilities from the environment */
+
+static void parse_faults(const char *spec) {
+  char buf[256];
+  strncpy(buf, spec, sizeof(buf) - 1);
+  buf[sizeof(buf) - 1] = 0;
+  for (char *tok = strtok(buf, ","); tok; tok = strtok(NULL, ",")) {
+    char *eq = strchr(tok, '=');
+    if (!eq) continue;
+    *eq = 0;
+    double p = strtod(eq + 1, NULL);
+    if (strcmp(tok, "nack") == 0) emu_faults.nack = p;
+    else if (strcmp(tok, "flip") == 0) emu_faults.flip = p;
+    else if (strcmp(tok, "tear") == 0) emu_faults.tear = p;
+    else if (strcmp(tok, "busy") == 0) emu_faults.busy = p;
+    else if (strcmp(tok, "noise") == 0) emu_faults.noise = (int)p;
+  }
+}
+
+/* Set up the emulator when the shim is loaded */
+
+__attribute__((constructor))
+static void emu_init_shim(void) {
+  real_open = dlsym(RTLD_NEXT, "open");
+  real_open64 = dlsym(RTLD_NEXT, "open64");
+  real_close = dlsym(RTLD_NEXT, "close");
+  real_flock = dlsym(RTLD_NEXT, "flock");
+  real_ioctl = dlsym(RTLD_NEXT, "ioctl");
+  const char *faults = getenv("LIFEPO4WERED_EMU_FAULTS");
+  if (faults) parse_faults(faults);
+  const char *seed = getenv("LIFEPO4WERED_EMU_SEED");
+  emu_seed = seed ? strtoul(seed, NULL, 0) : (unsigned int)getpid();
+  const char *adapter = getenv("LIFEPO4WERED_EMU_ADAPTER");
+  for (int i = 0; adapter && i < sizeof(emu_adapters)/sizeof(emu_adapters[0]);
+       i++) {
+    if (strcmp(adapter, emu_adapters[i].name) == 0)
+      emu_adapter = &emu_adapters[i];
+  }
+}
+
+/* Decide whether a fault with the specified probability occurs */
+
+static bool fault(double p) {
+  return p > 0 && rand_r(&emu_seed) < p * ((double)RAND_MAX + 1);
+}
+
+/* Map the shared register file, initializing it if necessary */
+
+static bool map_state(int fd) {
+  if (emu_state) return true;
+  if (ftruncate(fd, sizeof(struct sEmuState)) != 0) return false;
+  struct sEmuState *st = mmap(NULL, sizeof(struct sEmuState),
+                              PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if (st == MAP_FAILED) return false;
+  real_flock(fd, LOCK_EX);
+  if (st->magic != EMU_MAGIC) {
+    memset(st, 0, sizeof(*st));
+    for (int i = 0; i < sizeof(emu_init)/sizeof(emu_init[0]); i++) {
+      for (int b = 0; b < emu_init[i].bytes; b++) {
+        st->reg[emu_init[i].reg + b] = emu_init[i].value >> (8 * b);
+      }
+    }
+    for (int i = 0; i < EMU_ADC_COUNT; i++) {
+      uint8_t r = EMU_REG_ADC_FIRST + 2 * i;
+      st->adc_base[i] = st->reg[r] | (st->reg[r + 1] << 8);
+    }
+    st->magic = EMU_MAGIC;
+  }
+  real_flock(fd, LOCK_UN);
+  emu_state = st;
+  return true;
+}
+
+/* Determine if the path is an I2C device we need to emulate */
+
+static bool is_i2c_dev(const char *path) {
+  return path && strncmp(path, "/dev/i2c-", 9) == 0;
+}
+
+/* Open the register file in place of the I2C device, so the library's
+ * flock() calls provide real locking between emulated processes */
+
+static int open_emu(void) {
+  const char *file = getenv("LIFEPO4WERED_EMU_FILE");
+  int fd = real_open(file ? file : EMU_DEFAULT_FILE, O_RDWR|O_CREAT, 0666);
+  if (fd < 0) return fd;
+  if (fd >= EMU_MAX_FDS || !map_state(fd)) {
+    real_close(fd);
+    errno = EIO;
+    return -1;
+  }
+  emu_fds[fd] = 1;
+  emu_slave[fd] = 0;
+  return fd;
+}
+
+/* Determine if the file descriptor is an emulated I2C device */
+
+static bool is_emu_fd(int fd) {
+  return fd >= 0 && fd < EMU_MAX_FDS && emu_fds[fd];
+}
+
+/* Update the RTC registers from the system clock */
+
+static void update_rtc(void) {
+  uint32_t t = (uint32_t)(time(NULL) + emu_state->rtc_offset);
+  for (int b = 0; b < 4; b++) {
+    emu_state->reg[EMU_REG_RTC_TIME + b] = t >> (8 * b);
+  }
+}
+
+/* Update the ADC registers from their base values, applying the offset
+ * registers and noise */
+
+static void update_adc(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  int64_t now = (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+  bool new_sample = now / EMU_ADC_PERIOD != emu_state->adc_update;
+  emu_state->adc_update = now / EMU_ADC_PERIOD;
+  for (int i = 0; i < EMU_ADC_COUNT; i++) {
+    uint8_t o = EMU_REG_OFFSET + 2 * i;
+    uint8_t r = EMU_REG_ADC_FIRST + 2 * i;
+    int16_t offset = emu_state->reg[o] | (emu_state->reg[o + 1] << 8);
+    if (new_sample && emu_faults.noise > 0) {
+      emu_state->adc_noise[i] = rand_r(&emu_seed) %
+                  (2 * emu_faults.noise + 1) - emu_faults.noise;
+    }
+    int32_t v = emu_state->adc_base[i] + EMU_OFFSET_GAIN * offset +
+                emu_state->adc_noise[i];
+    if (v < 0) v = 0;
+    emu_state->reg[r] = v;
+    emu_state->reg[r + 1] = v >> 8;
+  }
+}
+
+/* Emulate a device register read */
+
+static void emu_read(uint8_t reg, uint16_t count, uint8_t *buf) {
+  /* A torn read happens when the micro updates an ADC value after the
+   * low byte has been sent */
+  int tear_at = -1;
+  if (fault(emu_faults.tear)) {
+    for (int r = EMU_REG_ADC_FIRST; r <= EMU_REG_ADC_LAST; r += 2) {
+      if (r >= reg && r + 1 < reg + count) {
+        tear_at = r;
+        break;
+      }
+    }
+  }
+  update_rtc();
+  update_adc();
+  for (uint16_t i = 0; i < count; i++) {
+    uint8_t r = reg + i;
+    buf[i] = emu_state->reg[r];
+    if (r == tear_at) {
+      uint16_t v = emu_state->reg[r] | (emu_state->reg[r + 1] << 8);
+      v += (emu_state->drift++ & 1) ? -1 : 1;
+      emu_state->reg[r] = v;
+      emu_state->reg[r + 1] = v >> 8;
+    }
+  }
+  /* The first bit on the wire (MSB of the first byte) may be wrong */
+  if (count && fault(emu_faults.flip)) {
+    buf[0] ^= 0x80;
+  }
+}
+
+/* Emulate a device register write */
+
+static void emu_write(const uint8_t *buf, uint16_t len) {
+  if (len < 1) return;
+  uint8_t reg = buf[0];
+  uint8_t header_len = 1;
+  if (emu_state->reg[0] >= EMU_WRUNLOCK_VER) {
+    /* Writes without a valid unlock byte are ignored */
+    if (len < 2 || buf[1] != ((EMU_I2C_ADDRESS << 1) ^ EMU_I2C_WR_UNLOCK ^ reg))
+      return;
+    header_len = 2;
+  }
+  for (uint16_t i = header_len; i < len; i++) {
+    emu_state->reg[(uint8_t)(reg + i - header_len)] = buf[i];
+  }
+  if (reg <= EMU_REG_RTC_TIME + 3 && reg + len - header_len > EMU_REG_RTC_TIME) {
+    uint32_t t = 0;
+    for (int b = 0; b < 4; b++) {
+      t |= (uint32_t)emu_state->reg[EMU_REG_RTC_TIME + b] << (8 * b);
+    }
+    emu_state->rtc_offset = (int64_t)t - time(NULL);
+  }
+}
+
+/* Emulate an I2C_RDWR transfer */
+
+/* Register pointer persists between transfers, like the real device */
+
+static uint8_t reg_ptr;
+
+static int emu_rdwr(struct i2c_rdwr_ioctl_data *rdwr) {
+  if (!rdwr || !rdwr->msgs || rdwr->nmsgs == 0 ||
+      rdwr->nmsgs > EMU_RDWR_MAX_MSGS) {
+    errno = EINVAL;
+    return -1;
+  }
+  /* Adapters that can't do it reject the transfer before it starts */
+  for (uint32_t i = 0; i < rdwr->nmsgs; i++) {
+    if (!(emu_adapter->funcs & I2C_FUNC_I2C) ||
+        (emu_adapter->max_read_len && (rdwr->msgs[i].flags & I2C_M_RD) &&
+         rdwr->msgs[i].len > emu_adapter->max_read_len)) {
+      errno = EOPNOTSUPP;
+      return -1;
+    }
+  }
+  for (uint32_t i = 0; i < rdwr->nmsgs; i++) {
+    if (rdwr->msgs[i].addr != EMU_I2C_ADDRESS || fault(emu_faults.nack)) {
+      errno = EREMOTEIO;
+      return -1;
+    }
+  }
+  for (uint32_t i = 0; i < rdwr->nmsgs; i++) {
+    struct i2c_msg *msg = &rdwr->msgs[i];
+    uint8_t *buf = (uint8_t *)msg->buf;
+    if (msg->flags & I2C_M_RD) {
+      emu_read(reg_ptr, msg->len, buf);
+      reg_ptr += msg->len;
+    } else if (msg->len > 0) {
+      reg_ptr = buf[0];
+      /* A write of just the register pointer sets up a read */
+      if (msg->len > 1) emu_write(buf, msg->len);
+    }
+  }
+  return rdwr->nmsgs;
+}
+
+/* Emulate an SMBus transfer */
+
+static int emu_smbus(int fd, struct i2c_smbus_ioctl_data *smbus) {
+  unsigned long func;
+  bool read = smbus->read_write == I2C_SMBUS_READ;
+  switch (smbus->size) {
+    case I2C_SMBUS_BYTE_DATA:
+      func = read ? I2C_FUNC_SMBUS_READ_BYTE_DATA
+                  : I2C_FUNC_SMBUS_WRITE_BYTE_DATA;
+      break;
+    case I2C_SMBUS_WORD_DATA:
+      func = read ? I2C_FUNC_SMBUS_READ_WORD_DATA
+                  : I2C_FUNC_SMBUS_WRITE_WORD_DATA;
+      break;
+    case I2C_SMBUS_I2C_BLOCK_DATA:
+      func = read ? I2C_FUNC_SMBUS_READ_I2C_BLOCK
+                  : I2C_FUNC_SMBUS_WRITE_I2C_BLOCK;
+      if (!smbus->data || smbus->data->block[0] < 1 ||
+          smbus->data->block[0] > I2C_SMBUS_BLOCK_MAX) {
+        errno = EINVAL;
+        return -1;
+      }
+      break;
+    default:
+      errno = EINVAL;
+      return -1;
+  }
+  if (!(emu_adapter->funcs & func)) {
+    errno = EOPNOTSUPP;
+    return -1;
+  }
+  if (emu_slave[fd] != EMU_I2C_ADDRESS || fault(emu_faults.nack)) {
+    errno = EREMOTEIO;
+    return -1;
+  }
+  /* Translate to the equivalent register pointer write and data
+   * transfer */
+  uint8_t buf[I2C_SMBUS_BLOCK_MAX + 1];
+  uint16_t len = smbus->size == I2C_SMBUS_BYTE_DATA ? 1 :
+                  smbus->size == I2C_SMBUS_WORD_DATA ? 2 :
+                  smbus->data->block[0];
+  reg_ptr = smbus->command;
+  if (read) {
+    emu_read(reg_ptr, len, buf);
+    reg_ptr += len;
+    if (smbus->size == I2C_SMBUS_BYTE_DATA)
+      smbus->data->byte = buf[0];
+    else if (smbus->size == I2C_SMBUS_WORD_DATA)
+      smbus->data->word = buf[0] | (buf[1] << 8);
+    else
+      memcpy(&smbus->data->block[1], buf, len);
+  } else {
+    buf[0] = smbus->command;
+    if (smbus->size == I2C_SMBUS_BYTE_DATA) {
+      buf[1] = smbus->data->byte;
+    } else if (smbus->size == I2C_SMBUS_WORD_DATA) {
+      buf[1] = smbus->data->word;
+      buf[2] = smbus->data->word >> 8;
+    } else {
+      memcpy(&buf[1], &smbus->data->block[1], len);
+    }
+    emu_write(buf, len + 1);
+  }
+  return 0;
+}
+
+/* Intercepted libc functions */
+
+int open(const char *path, int flags, ...) {
+  if (is_i2c_dev(path)) return open_emu();
+  mode_t mode = 0;
+  if (flags & (O_CREAT|O_TMPFILE)) {
+    va_list ap;
+    va_start(ap, flags);
+    mode = va_arg(ap, mode_t);
+    va_end(ap);
+  }
+  return real_open(path, flags, mode);
+}
+
+int open64(const char *path, int flags, ...) {
+  if (is_i2c_dev(path)) return open_emu();
+  mode_t mode = 0;
+  if (flags & (O_CREAT|O_TMPFILE)) {
+    va_list ap;
+    va_start(ap, flags);
+    mode = va_arg(ap, mode_t);
+    va_end(ap);
+  }
+  return real_open64(path, flags, mode);
+}
+
+int close(int fd) {
+  if (fd >= 0 && fd < EMU_MAX_FDS) emu_fds[fd] = 0;
+  return real_close(fd);
+}
+
+int flock(int fd, int operation) {
+  if (is_emu_fd(fd) && (operation & LOCK_EX) && fault(emu_faults.busy)) {
+    errno = EWOULDBLOCK;
+    return -1;
+  }
+  return real_flock(fd, operation);
+}
+
+int ioctl(int fd, unsigned long request, ...) {
+  va_list ap;
+  va_start(ap, request);
+  void *arg = va_arg(ap, void *);
+  va_end(ap);
+  if (!is_emu_fd(fd)) return real_ioctl(fd, request, arg);
+  switch (request) {
+    case I2C_RDWR:
+      return emu_rdwr(arg);
+    case I2C_SMBUS:
+      return emu_smbus(fd, arg);
+    case I2C_SLAVE:
+    case I2C_SLAVE_FORCE:
+      emu_slave[fd] = (uintptr_t)arg;
+      return 0;
+    case I2C_FUNCS:
+      *(unsigned long *)arg = emu_adapter->funcs;
+      return 0;
+    default:
+      errno = ENOTTY;
+      return -1;
+  }
+}
@@ -0,0 +1,334 @@
+/*
+ * LiFePO4wered/Pi register map generator
+ * Generates the flattened per-version register tables used by the data
+ * module, and the constants used by the language bindings, from the
+ * register map in lifepo4wered-regs.def.
+ *
+ * Usage: lifepo4wered-gen <h|c|py|js>
+ *
+ * Copyright (C) 2020 Patrick Van Oosterwijck
+ * Released under the GPL v2
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "lifepo4wered-data.h"
+
+
+/* Register not available in a register version */
+
+#define R_NA                  0xFF
+
+/* Maximum number of register versions and scale variants */
+
+#define MAX_REG_VERS          32
+#define MAX_SCALE_VARIANTS    8
+
+/* Maximum fixed point shift */
+
+#define MAX_SHIFT             48
+
+/* Terminator used to check the length of lists */
+
+#define END                   -1
+
+/* Expand a parenthesized list */
+
+#define LFP_LIST(...)         __VA_ARGS__
+
+
+/* Scale variant used by each register version */
+
+#define LFP_SCALE_VARIANTS(VARIANTS) { LFP_LIST VARIANTS, END }
+
+static const int scale_variant[MAX_REG_VERS + 1] =
+#include "lifepo4wered-regs.def"
+;
+
+/* Scale factor sets */
+
+#define LFP_SCALE(NAME, FACTORS) NAME,
+
+enum eScale {
+#include "lifepo4wered-regs.def"
+  SCALE_COUNT
+};
+
+#define LFP_SCALE(NAME, FACTORS) { #NAME, { LFP_LIST FACTORS, END } },
+
+static const struct sScaleSpec {
+  const char    *name;
+  int32_t       factors[2 * MAX_SCALE_VARIANTS + 1];
+} scale_spec[SCALE_COUNT] = {
+#include "lifepo4wered-regs.def"
+};
+
+/* Variables */
+
+#define LFP_VAR(NAME, READ_BYTES, WRITE_BYTES, SIGN_EXTEND, SCALE, REGS) \
+  { #NAME, READ_BYTES, WRITE_BYTES, SIGN_EXTEND, SCALE,                 \
+    { LFP_LIST REGS, END } },
+
+static const struct sVarSpec {
+  const char    *name;
+  uint8_t       read_bytes;
+  uint8_t       write_bytes;
+  uint8_t       sign_extend;
+  enum eScale   scale;
+  int           reg[MAX_REG_VERS + 1];
+} var_spec[LFP_VAR_COUNT] = {
+#include "lifepo4wered-regs.def"
+};
+
+/* Constants, and the section titles grouping them */
+
+#define LFP_SECTION(TITLE) { TITLE, NULL, 0 },
+#define LFP_CONST(NAME, VALUE) { NULL, #NAME, VALUE },
+
+static const struct sConstSpec {
+  const char    *section;
+  const char    *name;
+  int           value;
+} const_spec[] = {
+#include "lifepo4wered-regs.def"
+};
+
+#define CONST_COUNT (sizeof(const_spec) / sizeof(const_spec[0]))
+
+/* Fixed point decoding of a variable */
+
+struct sFixedPoint {
+  int64_t       mul;
+  int64_t       round;
+  uint8_t       shift;
+};
+
+/* Register map dimensions found while checking it */
+
+static int reg_ver_count;
+static int scale_variant_count;
+
+
+/* Report an error in the register map and exit */
+
+static void fail(const char *what, const char *name) {
+  fprintf(stderr, "lifepo4wered-regs.def: %s: %s\n", what, name);
+  exit(1);
+}
+
+/* Check that all lists in the register map have the right length */
+
+static void check_spec(void) {
+  while (reg_ver_count < MAX_REG_VERS && scale_variant[reg_ver_count] != END) {
+    if (scale_variant[reg_ver_count] + 1 > scale_variant_count)
+      scale_variant_count = scale_variant[reg_ver_count] + 1;
+    reg_ver_count++;
+  }
+  if (!reg_ver_count || scale_variant_count > MAX_SCALE_VARIANTS)
+    fail("invalid scale variants", "LFP_SCALE_VARIANTS");
+  for (int i = 0; i < SCALE_COUNT; i++) {
+    const int32_t *f = scale_spec[i].factors;
+    if (f[2 * scale_variant_count] != END)
+      fail("wrong number of scale factors", scale_spec[i].name);
+    for (int v = 0; v < scale_variant_count; v++) {
+      if (f[2 * v] <= 0 || f[2 * v + 1] <= 0)
+        fail("invalid scale factors", scale_spec[i].name);
+    }
+  }
+  for (int var = 0; var < LFP_VAR_COUNT; var++) {
+    if (var_spec[var].reg[reg_ver_count] != END)
+      fail("wrong number of registers", var_spec[var].name);
+  }
+}
+
+/* Divide rounding towards negative infinity */
+
+static int64_t floor_div(int64_t a, int64_t b) {
+  int64_t q = a / b;
+  return (a % b != 0 && (a < 0) != (b < 0)) ? q - 1 : q;
+}
+
+/* Find the fixed point decoding that gives the same result as rounding
+ * raw * mul / div to the nearest integer for every raw value the
+ * variable can have, with the smallest shift.  This is checked for
+ * every raw value, so the tables are exact by construction. */
+
+static void fixed_point(const struct sVarSpec *vs, int32_t mul, int32_t div,
+                        struct sFixedPoint *fp) {
+  if (mul % div == 0) {
+    fp->mul = mul / div;
+    fp->round = 0;
+    fp->shift = 0;
+    return;
+  }
+  if (vs->read_bytes > 2)
+    fail("fractional scale on a wide register", vs->name);
+  int64_t lo = vs->sign_extend ? -32768 : 0;
+  int64_t hi = vs->sign_extend ? 32767 : (1 << (8 * vs->read_bytes)) - 1;
+  int64_t max_abs = -lo > hi ? -lo : hi;
+  for (int shift = 1; shift <= MAX_SHIFT; shift++) {
+    fp->shift = shift;
+    fp->mul = floor_div(((int64_t)mul << shift) + div / 2, div);
+    /* Bias the rounding constant to absorb the multiplier error, so
+     * exact halves round up for negative values too */
+    fp->round = ((int64_t)1 << (shift - 1)) + max_abs / 2 + 1;
+    int64_t raw;
+    for (raw = lo; raw <= hi; raw++) {
+      int64_t exact = floor_div(2 * raw * mul + div, 2 * (int64_t)div);
+      if (((raw * fp->mul + fp->round) >> shift) != exact) break;
+    }
+    if (raw > hi) return;
+  }
+  fail("no exact fixed point decoding", vs->name);
+}
+
+/* Print the generated file header */
+
+static void print_header(const char *comment, const char *title) {
+  printf("%s%s\n", comment, title);
+  printf("%sGenerated from lifepo4wered-regs.def by lifepo4wered-gen, "
+         "do not edit\n", comment);
+}
+
+/* Generate the register table header */
+
+static void generate_h(void) {
+  printf("/*\n");
+  print_header(" * ", "LiFePO4wered/Pi register tables");
+  printf(" */\n\n");
+  printf("#ifndef LIFEPO4WERED_REGS_H\n#define LIFEPO4WERED_REGS_H\n\n");
+  printf("#include <stdint.h>\n#include \"lifepo4wered-data.h\"\n\n\n");
+  printf("/* Number of I2C register versions defined */\n\n");
+  printf("#define I2C_REG_VER_COUNT     %d\n\n", reg_ver_count);
+  printf("/* Register not available in a register version */\n\n");
+  printf("#define R_NA                  0x%02X\n\n\n", R_NA);
+  printf(
+"/* Variable definition for a register version.  The value is decoded\n"
+" * from the raw register value as (raw * mul + round) >> shift, which\n"
+" * is the same as rounding raw * scale_mul / scale_div to the nearest\n"
+" * integer for every raw value the register can have. */\n\n"
+"struct sVarDesc {\n"
+"  uint8_t       reg;\n"
+"  uint8_t       read_bytes;\n"
+"  uint8_t       write_bytes;\n"
+"  uint8_t       sign_extend;\n"
+"  uint8_t       shift;\n"
+"  int64_t       mul;\n"
+"  int64_t       round;\n"
+"  int32_t       scale_mul;\n"
+"  int32_t       scale_div;\n"
+"};\n\n"
+"/* Register block covering all variables read in a snapshot */\n\n"
+"struct sBlockLayout {\n"
+"  uint8_t       first_reg;\n"
+"  uint8_t       length;\n"
+"};\n\n\n"
+"/* Variable definitions for each register version */\n\n"
+"extern const struct sVarDesc\n"
+"  lifepo4wered_var_desc[I2C_REG_VER_COUNT][LFP_VAR_COUNT];\n\n"
+"/* Snapshot register block for each register version */\n\n"
+"extern const struct sBlockLayout\n"
+"  lifepo4wered_snapshot_layout[I2C_REG_VER_COUNT];\n\n\n"
+"#endif\n");
+}
+
+/* Generate the register tables */
+
+static void generate_c(void) {
+  printf("/*\n");
+  print_header(" * ", "LiFePO4wered/Pi register tables");
+  printf(" */\n\n#include \"lifepo4wered-regs.h\"\n\n\n");
+  printf("const struct sVarDesc\n"
+         "  lifepo4wered_var_desc[I2C_REG_VER_COUNT][LFP_VAR_COUNT] = {\n");
+  for (int ver = 0; ver < reg_ver_count; ver++) {
+    printf("  /* Register version %d */\n  {\n", ver + 1);
+    for (int var = 0; var < LFP_VAR_COUNT; var++) {
+      const struct sVarSpec *vs = &var_spec[var];
+      const int32_t *f = &scale_spec[vs->scale].factors[
+                                2 * scale_variant[ver]];
+      struct sFixedPoint fp;
+      fixed_point(vs, f[0], f[1], &fp);
+      printf("    /* %-19s */ { 0x%02X, %d, %d, %d, %2d, %14lld, %14lld, "
+             "%6d, %6d },\n", vs->name, vs->reg[ver], vs->read_bytes,
+             vs->write_bytes, vs->sign_extend, fp.shift,
+             (long long)fp.mul, (long long)fp.round, f[0], f[1]);
+    }
+    printf("  },\n");
+  }
+  printf("};\n\n");
+  printf("const struct sBlockLayout\n"
+         "  lifepo4wered_snapshot_layout[I2C_REG_VER_COUNT] = {\n");
+  for (int ver = 0; ver < reg_ver_count; ver++) {
+    int first = R_NA, end = 0;
+    for (int var = 0; var < LFP_VAR_COUNT; var++) {
+      const struct sVarSpec *vs = &var_spec[var];
+      if (var == I2C_REG_VER || vs->reg[ver] == R_NA || !vs->read_bytes)
+        continue;
+      if (vs->reg[ver] < first) first = vs->reg[ver];
+      if (vs->reg[ver] + vs->read_bytes > end)
+        end = vs->reg[ver] + vs->read_bytes;
+    }
+    printf("  /* Register version %d */ { 0x%02X, %d },\n", ver + 1,
+           first, end - first);
+  }
+  printf("};\n");
+}
+
+/* Generate the binding constants, with the syntax given by the comment
+ * leader, name format, assignment separator and terminator */
+
+static void generate_binding(const char *comment, const char *name_fmt,
+                             const char *sep, const char *term,
+                             const char *indent) {
+  print_header(comment, "LiFePO4wered/Pi register map constants");
+  if (*indent) printf("\nexports.constants = {\n");
+  printf("\n%s%sVariable definitions\n\n", indent, comment);
+  for (int var = 0; var < LFP_VAR_COUNT; var++) {
+    printf("%s", indent);
+    printf(name_fmt, var_spec[var].name);
+    printf("%s%d%s\n", sep, var, term);
+  }
+  for (int i = 0; i < CONST_COUNT; i++) {
+    if (const_spec[i].section) {
+      printf("\n%s%s%s\n\n", indent, comment, const_spec[i].section);
+    } else {
+      printf("%s", indent);
+      printf(name_fmt, const_spec[i].name);
+      printf("%s0x%02X%s\n", sep, const_spec[i].value, term);
+    }
+  }
+  if (*indent) {
+    printf("\n};\n\n%sVariable names indexed by variable number\n\n"
+           "exports.VAR_NAMES = [\n", comment);
+    for (int var = 0; var < LFP_VAR_COUNT; var++) {
+      printf("  '%s'%s\n", var_spec[var].name,
+             var < LFP_VAR_COUNT - 1 ? "," : "");
+    }
+    printf("];\n");
+  }
+}
+
+/* Program entry point */
+
+int main(int argc, char *argv[]) {
+  if (argc != 2) {
+    fprintf(stderr, "Usage: %s <h|c|py|js>\n", argv[0]);
+    return 1;
+  }
+  check_spec();
+  if (strcmp(argv[1], "h") == 0) {
+    generate_h();
+  } else if (strcmp(argv[1], "c") == 0) {
+    generate_c();
+  } else if (strcmp(argv[1], "py") == 0) {
+    generate_binding("# ", "%-21s", " = ", "", "");
+  } else if (strcmp(argv[1], "js") == 0) {
+    generate_binding("// ", "%-22s", ": ", ",", "  ");
+  } else {
+    fprintf(stderr, "Unknown output: %s\n", argv[1]);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,119 @@
+/*
+ * LiFePO4wered/Pi I2C transfer trace analysis tool
+ * Copyright (C) 2020 Patrick Van Oosterwijck
+ * Released under the GPL v2
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "lifepo4wered-trace.h"
+
+
+/* Highest retry number reported separately in the retry distribution */
+
+#define MAX_RETRY_BIN       8
+
+/* Per-register statistics */
+
+struct sRegStats {
+  uint32_t  transfers[2];     /* Reads, writes */
+  uint32_t  bus_errors;       /* Could not open or lock the bus */
+  uint32_t  xfer_errors;      /* Transfer failed */
+  uint32_t  retries;          /* Transfers beyond what a clean access needs */
+  uint64_t  duration;         /* Total transfer time (ns) */
+  uint32_t  max_duration;     /* Longest transfer (ns) */
+  uint64_t  lock_wait;        /* Total bus open and lock time (ns) */
+};
+
+static struct sRegStats reg_stats[256];
+
+/* Number of transfers with each retry number, an access that needed n
+ * retries recorded one transfer with each retry number from 1 to n */
+
+static uint64_t retry_counts[257];
+
+/* Program entry point */
+
+int main(int argc, char *argv[]) {
+  if (argc != 2) {
+    printf("Usage: %s <trace file>\n", argv[0]);
+    return 1;
+  }
+
+  FILE *f = fopen(argv[1], "rb");
+  if (!f) {
+    perror(argv[1]);
+    return 2;
+  }
+  struct sTraceHeader hdr;
+  if (fread(&hdr, sizeof(hdr), 1, f) != 1 || hdr.magic != TRACE_MAGIC ||
+      hdr.version != TRACE_VERSION) {
+    fprintf(stderr, "ERROR: %s is not a LiFePO4wered trace file\n", argv[1]);
+    fclose(f);
+    return 3;
+  }
+
+  struct sTraceRecord rec;
+  uint64_t count = 0, first = UINT64_MAX, last = 0, busy = 0;
+  uint8_t payload[255];
+
+  while (fread(&rec, sizeof(rec), 1, f) == 1) {
+    if (TRACE_HAS_PAYLOAD(&rec) &&
+        fread(payload, 1, rec.count, f) != rec.count)
+      break;
+    struct sRegStats *rs = &reg_stats[rec.reg];
+    uint8_t op = rec.op & TRACE_OP_MASK;
+    rs->transfers[op == TRACE_OP_WRITE]++;
+    if (rec.result == TRACE_EBUS) rs->bus_errors++;
+    if (rec.result == TRACE_EXFER) rs->xfer_errors++;
+    rs->duration += rec.duration;
+    if (rec.duration > rs->max_duration) rs->max_duration = rec.duration;
+    rs->lock_wait += rec.lock_wait;
+    if (rec.retry) rs->retries++;
+    retry_counts[rec.retry]++;
+    /* Processes append to the trace concurrently, so records are not
+     * necessarily in time order */
+    if (rec.timestamp < first) first = rec.timestamp;
+    if (rec.timestamp + rec.lock_wait + rec.duration > last)
+      last = rec.timestamp + rec.lock_wait + rec.duration;
+    busy += rec.duration;
+    count++;
+  }
+  fclose(f);
+
+  printf("REG   READS  WRITES  BUSERR  XFERERR  RETRIES  "
+         "AVG_US  MAX_US  LOCK_US\n");
+  for (int r = 0; r < 256; r++) {
+    struct sRegStats *rs = &reg_stats[r];
+    uint32_t n = rs->transfers[0] + rs->transfers[1];
+    if (!n) continue;
+    printf("0x%02X %6u  %6u  %6u  %7u  %7u  %6.1f  %6.1f  %7.1f\n", r,
+           rs->transfers[0], rs->transfers[1], rs->bus_errors,
+           rs->xfer_errors, rs->retries,
+           rs->duration / 1000.0 / n, rs->max_duration / 1000.0,
+           rs->lock_wait / 1000.0 / n);
+  }
+
+  if (retry_counts[1]) {
+    printf("\nRETRIES  ACCESSES\n");
+    for (int r = 1; r <= MAX_RETRY_BIN; r++) {
+      uint64_t n = retry_counts[r] - retry_counts[r + 1];
+      if (n) printf("%7d  %8llu\n", r, (unsigned long long)n);
+    }
+    if (retry_counts[MAX_RETRY_BIN + 1]) {
+      printf("%6d+  %8llu\n", MAX_RETRY_BIN + 1,
+             (unsigned long long)retry_counts[MAX_RETRY_BIN + 1]);
+    }
+  }
+
+  if (!count) first = 0;
+  double span = (last - first) / 1e9;
+  printf("\n%llu transfers in %.3f s\n", (unsigned long long)count, span);
+  if (span > 0) {
+    printf("Bus occupancy: %.3f%% (%.1f us/s)\n",
+           100.0 * busy / (last - first), busy / 1000.0 / span);
+  }
+
+  return 0;
+}
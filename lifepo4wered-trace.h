@@ -0,0 +1,66 @@
+/*
+ * LiFePO4wered/Pi I2C transfer trace format
+ * Copyright (C) 2020 Patrick Van Oosterwijck
+ * Released under the GPL v2
+ */
+
+#ifndef LIFEPO4WERED_TRACE_H
+#define LIFEPO4WERED_TRACE_H
+
+#include <stdint.h>
+
+
+/* Trace file header magic and format version */
+
+#define TRACE_MAGIC         0x5450464C  /* "LFPT" */
+#define TRACE_VERSION       2
+
+/* Transfer operations */
+
+#define TRACE_OP_READ       0x01
+#define TRACE_OP_WRITE      0x02
+#define TRACE_OP_UNLOCK     0x80        /* Write with unlock byte */
+#define TRACE_OP_MASK       0x0F
+
+/* Transfer results */
+
+#define TRACE_OK            0           /* Transfer succeeded */
+#define TRACE_EBUS          1           /* Could not open or lock the bus */
+#define TRACE_EXFER         2           /* Transfer failed */
+
+/* Environment variables controlling recording and replay */
+
+#define TRACE_ENV_RECORD        "LIFEPO4WERED_TRACE"
+#define TRACE_ENV_REPLAY        "LIFEPO4WERED_REPLAY"
+#define TRACE_ENV_REPLAY_SPEED  "LIFEPO4WERED_REPLAY_SPEED"
+
+/* Trace file header */
+
+struct sTraceHeader {
+  uint32_t  magic;
+  uint32_t  version;
+};
+
+/* Trace record, followed by count bytes of payload for successful reads
+ * and for all writes.  Records are stored in host byte order. */
+
+struct __attribute__((packed)) sTraceRecord {
+  uint64_t  timestamp;    /* Monotonic time at transfer start (ns) */
+  uint32_t  lock_wait;    /* Time spent opening and locking the bus (ns) */
+  uint32_t  duration;     /* Time spent in the bus transfer (ns) */
+  uint8_t   op;           /* TRACE_OP_* */
+  uint8_t   reg;          /* Register address */
+  uint8_t   count;        /* Number of data bytes */
+  uint8_t   result;       /* TRACE_* result */
+  uint8_t   retry;        /* Retry number within the access, 0 for the
+                             transfers a clean access needs */
+};
+
+/* Determine if a trace record carries payload */
+
+#define TRACE_HAS_PAYLOAD(rec) \
+  (((rec)->op & TRACE_OP_MASK) == TRACE_OP_WRITE || \
+   (rec)->result == TRACE_OK)
+
+
+#endif
@@ -0,0 +1,98 @@
+#!/bin/sh
+#
+# LiFePO4wered/Pi bus time budget test
+# Copyright (C) 2020 Patrick Van Oosterwijck
+# Released under the GPL v2
+#
+# Runs the CLI against the I2C device emulator with the bus time budget
+# used up, and checks that writes still go through and are accounted,
+# that only registers that don't change by themselves are served from
+# the cache, and that an unsafe shared state file is not used.  Also
+# checks that values that were read can be written back unchanged.
+#
+# Usage: tests/bus-budget.sh
+#
+
+BUILD=$(cd "$(dirname "$0")/../build" && pwd) || exit 1
+for f in lifepo4wered-cli liblifepo4wered-emu.so; do
+  if [ ! -e "$BUILD/$f" ]; then
+    echo "ERROR: $BUILD/$f missing, run 'make all emu'" >&2
+    exit 1
+  fi
+done
+
+WORK=$(mktemp -d) || exit 1
+trap 'rm -rf "$WORK"' EXIT
+
+export LD_PRELOAD="$BUILD/liblifepo4wered-emu.so"
+export LIFEPO4WERED_EMU_FILE="$WORK/emu"
+export LIFEPO4WERED_BUS_STATE="$WORK/bus"
+unset LIFEPO4WERED_BUS_BUDGET
+
+failures=0
+
+# Check that a command prints the expected output and exit status
+check() {
+  name=$1; expect=$2; expect_status=$3; shift 3
+  output=$("$@" 2>&1)
+  status=$?
+  if [ "$output" = "$expect" ] && [ $status -eq "$expect_status" ]; then
+    echo "ok    $name"
+  else
+    echo "FAIL  $name: got '$output' ($status), expected '$expect'" \
+         "($expect_status)"
+    failures=$((failures + 1))
+  fi
+}
+
+# Get a bus statistic
+bus_stat() {
+  "$BUILD/lifepo4wered-cli" bus | sed -n "s/^$1 = //p"
+}
+
+# Negative values round the same way when written as when read
+"$BUILD/lifepo4wered-cli" bus 0 > /dev/null
+check "negative offset written back" -5 0 \
+      "$BUILD/lifepo4wered-cli" set vbat_offset -5
+check "negative offset read back" -5 0 \
+      "$BUILD/lifepo4wered-cli" get vbat_offset
+"$BUILD/lifepo4wered-cli" set vbat_offset 0 > /dev/null
+
+# Fill the cache without a budget, then use up a budget of 1 us/s
+"$BUILD/lifepo4wered-cli" get > /dev/null
+"$BUILD/lifepo4wered-cli" bus 1 > /dev/null
+"$BUILD/lifepo4wered-cli" get vin > /dev/null
+"$BUILD/lifepo4wered-cli" get vin > /dev/null
+
+check "cached read over budget" 3300 0 "$BUILD/lifepo4wered-cli" get vbat
+check "uncached RTC read over budget" -2 6 \
+      "$BUILD/lifepo4wered-cli" get rtc_time
+check "uncached touch read over budget" -2 6 \
+      "$BUILD/lifepo4wered-cli" get touch_state
+
+over=$(bus_stat BUS_OVER_BUDGET)
+check "write over budget" 3 0 "$BUILD/lifepo4wered-cli" set led_state 3
+check "written value cached" 3 0 "$BUILD/lifepo4wered-cli" get led_state
+check "write accounted" yes 0 \
+      sh -c "[ $(bus_stat BUS_OVER_BUDGET) -gt $over ] && echo yes"
+
+# A shared state file behind a symlink or owned by another user is not
+# used
+refused="ERROR: Can't access the shared bus state"
+: > "$WORK/target"
+ln -s "$WORK/target" "$WORK/link"
+check "symlinked state refused" "$refused" 6 \
+      env LIFEPO4WERED_BUS_STATE="$WORK/link" "$BUILD/lifepo4wered-cli" bus
+check "symlink target untouched" 0 0 stat -c %s "$WORK/target"
+if [ "$(id -u)" -eq 0 ]; then
+  : > "$WORK/other"
+  chown nobody "$WORK/other"
+  check "foreign state refused" "$refused" 6 \
+        env LIFEPO4WERED_BUS_STATE="$WORK/other" "$BUILD/lifepo4wered-cli" bus
+fi
+
+if [ $failures -ne 0 ]; then
+  echo "$failures bus budget tests failed"
+  exit 1
+fi
+echo "PASS"
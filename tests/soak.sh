@@ -0,0 +1,132 @@
+#!/bin/sh
+#
+# LiFePO4wered/Pi soak test
+# Copyright (C) 2020 Patrick Van Oosterwijck
+# Released under the GPL v2
+#
+# Runs concurrent CLI and library clients against the I2C device emulator
+# with injected faults, then reports error rates, retries and throughput.
+# Fails if any client read a wrong value, or if the error rate exceeds
+# the allowed maximum.
+#
+# Usage: tests/soak.sh [-c clients] [-t seconds] [-f faults] [-s seed]
+#                      [-e max error %]
+#
+
+CLIENTS=4
+DURATION=30
+FAULTS="nack=0.01,flip=0.02,tear=0.01,busy=0.01"
+SEED=
+MAX_ERRORS=1
+
+while getopts c:t:f:s:e: opt; do
+  case $opt in
+    c) CLIENTS=$OPTARG ;;
+    t) DURATION=$OPTARG ;;
+    f) FAULTS=$OPTARG ;;
+    s) SEED=$OPTARG ;;
+    e) MAX_ERRORS=$OPTARG ;;
+    *) sed -n '/^# Usage/,/^#$/s/^# \{0,1\}//p' "$0"; exit 1 ;;
+  esac
+done
+
+BUILD=$(cd "$(dirname "$0")/../build" && pwd) || exit 1
+for f in lifepo4wered-cli lifepo4wered-trace liblifepo4wered-emu.so async-epoll; do
+  if [ ! -e "$BUILD/$f" ]; then
+    echo "ERROR: $BUILD/$f missing, run 'make all emu examples'" >&2
+    exit 1
+  fi
+done
+
+WORK=$(mktemp -d) || exit 1
+trap 'rm -rf "$WORK"' EXIT
+
+# Every client shares a private emulated device and records to one trace,
+# the bus budget is disabled so only injected faults cause errors
+export LD_PRELOAD="$BUILD/liblifepo4wered-emu.so"
+export LIFEPO4WERED_EMU_FILE="$WORK/emu"
+export LIFEPO4WERED_BUS_STATE=
+export LIFEPO4WERED_TRACE="$WORK/trace"
+
+# Reference values read without faults, leaving out registers that change
+# by themselves
+"$BUILD/lifepo4wered-cli" get | \
+  grep -v -e '^RTC_TIME ' -e '^TOUCH_STATE ' -e '^WATCHDOG_TIMER ' \
+  > "$WORK/reference"
+if grep -q ' = -' "$WORK/reference"; then
+  echo "ERROR: could not read reference values" >&2
+  exit 1
+fi
+VARS=$(cut -d' ' -f1 "$WORK/reference")
+
+export LIFEPO4WERED_EMU_FAULTS="$FAULTS"
+
+# CLI client: reads single variables and full snapshots, counting reads
+# that returned the reference value, failed or returned a wrong value
+cli_client() {
+  n=$1
+  [ -n "$SEED" ] && export LIFEPO4WERED_EMU_SEED=$((SEED + n))
+  ok=0; err=0; bad=0
+  end=$(($(date +%s) + DURATION))
+  while [ "$(date +%s)" -lt "$end" ]; do
+    for var in $VARS; do
+      expect=$(sed -n "s/^$var = //p" "$WORK/reference")
+      value=$("$BUILD/lifepo4wered-cli" get "$var")
+      if [ "$value" = "$expect" ]; then ok=$((ok + 1))
+      elif [ "${value#-}" != "$value" ]; then err=$((err + 1))
+      else bad=$((bad + 1)); echo "client $n: $var = $value" >&2
+      fi
+    done
+    "$BUILD/lifepo4wered-cli" get > "$WORK/snapshot.$n"
+    while read -r var eq value; do
+      expect=$(sed -n "s/^$var = //p" "$WORK/reference")
+      [ -z "$expect" ] && continue
+      if [ "$value" = "$expect" ]; then ok=$((ok + 1))
+      elif [ "${value#-}" != "$value" ]; then err=$((err + 1))
+      else bad=$((bad + 1)); echo "client $n: $var = $value" >&2
+      fi
+    done < "$WORK/snapshot.$n"
+  done
+  echo "$ok $err $bad" > "$WORK/client.$n"
+}
+
+# Library client: keeps asynchronous requests outstanding
+lib_client() {
+  n=$1
+  [ -n "$SEED" ] && export LIFEPO4WERED_EMU_SEED=$((SEED + n))
+  end=$(($(date +%s) + DURATION))
+  while [ "$(date +%s)" -lt "$end" ]; do
+    "$BUILD/async-epoll" 4 200 | sed -n 's/^\([0-9]*\) requests, .*, \([0-9]*\) errors.*/\1 \2/p'
+  done | awk '{ n += $1; e += $2 } END { print n - e, e + 0, 0 }' \
+    > "$WORK/client.$n"
+}
+
+echo "Running $CLIENTS CLI clients and 1 library client for $DURATION s"
+echo "Faults: $FAULTS"
+n=0
+while [ $n -lt "$CLIENTS" ]; do
+  cli_client $n &
+  n=$((n + 1))
+done
+lib_client $n &
+wait
+
+cat "$WORK"/client.* | awk -v duration="$DURATION" -v max="$MAX_ERRORS" '
+  { ok += $1; err += $2; bad += $3 }
+  END {
+    total = ok + err + bad
+    rate = total ? 100.0 * err / total : 100
+    printf "\n%d reads, %d failed (%.3f%%), %d wrong, %.1f reads/s\n\n",
+           total, err, rate, bad, total / duration
+    exit (bad > 0 || rate > max) ? 1 : 0
+  }'
+status=$?
+
+unset LD_PRELOAD
+"$BUILD/lifepo4wered-trace" "$WORK/trace"
+
+if [ $status -ne 0 ]; then
+  printf "\nFAIL: wrong values or error rate above %s%%\n" "$MAX_ERRORS"
+  exit 1
+fi
+printf "\nPASS\n"
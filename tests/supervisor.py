@@ -0,0 +1,213 @@
+#!/usr/bin/env python3
+#
+# LiFePO4wered/Pi daemon test against a stand-in Balena supervisor
+# Copyright (C) 2020 Patrick Van Oosterwijck
+# Released under the GPL v2
+#
+# Runs the Balena build of the daemon against the I2C device emulator,
+# with a local HTTP listener standing in for the supervisor.  Checks the
+# shutdown request the daemon sends, and that it falls back to the curl
+# shutdown command when the supervisor refuses, drops or doesn't answer
+# the request, or isn't there at all.
+#
+# Usage: tests/supervisor.py
+#
+
+import os
+import signal
+import socket
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+ROOT = os.path.join(os.path.dirname(os.path.abspath(__file__)), '..')
+BUILD = os.path.join(ROOT, 'build')
+DAEMON = os.path.join(BUILD, 'lifepo4wered-daemon-balena')
+CLI = os.path.join(BUILD, 'lifepo4wered-cli')
+EMU = os.path.join(BUILD, 'liblifepo4wered-emu.so')
+API_KEY = 'f00dfeed'
+
+
+class Supervisor(threading.Thread):
+    """Stand-in supervisor: accepts one connection, records the request
+    and answers it according to the behavior:
+    a status line to send, 'close' to hang up or 'hang' to not answer"""
+
+    def __init__(self, behavior):
+        super().__init__(daemon=True)
+        self.behavior = behavior
+        self.request = b''
+        self.listener = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        self.listener.bind(('127.0.0.1', 0))
+        self.listener.listen(1)
+        self.listener.settimeout(60)
+        self.port = self.listener.getsockname()[1]
+        self.start()
+
+    def run(self):
+        try:
+            conn, _ = self.listener.accept()
+        except OSError:
+            return
+        with conn:
+            conn.settimeout(10)
+            while b'\r\n\r\n' not in self.request:
+                data = conn.recv(1024)
+                if not data:
+                    break
+                self.request += data
+            # Pick up anything sent after the header as body
+            conn.settimeout(0.2)
+            try:
+                self.request += conn.recv(1024)
+            except OSError:
+                pass
+            if self.behavior == 'hang':
+                time.sleep(10)
+            elif self.behavior != 'close':
+                conn.sendall(self.behavior.encode() +
+                             b'\r\nContent-Length: 0\r\n\r\n')
+
+    def close(self):
+        self.listener.close()
+
+
+def run_daemon(work, address):
+    """Run the daemon until the emulated device asks the Pi to shut down,
+    returning its log and the arguments curl was run with, if it was"""
+    env = dict(os.environ)
+    env.update({
+        'LD_PRELOAD': EMU,
+        'LIFEPO4WERED_EMU_FILE': os.path.join(work, 'emu'),
+        'LIFEPO4WERED_BUS_STATE': '',
+        'LIFEPO4WERED_HOOK_DIR': os.path.join(work, 'hooks'),
+        'BALENA_SUPERVISOR_ADDRESS': address,
+        'BALENA_SUPERVISOR_API_KEY': API_KEY,
+        'PATH': os.path.join(work, 'bin') + ':' + env.get('PATH', ''),
+    })
+    curl_log = os.path.join(work, 'curl.log')
+    if os.path.exists(curl_log):
+        os.remove(curl_log)
+    daemon = subprocess.Popen([DAEMON, '-f'], env=env,
+                              stdout=subprocess.PIPE,
+                              stderr=subprocess.STDOUT)
+    # Wait until the daemon flagged the Pi running, then clear the flag
+    # like the device does when it wants the Pi to shut down
+    for _ in range(100):
+        out = subprocess.run([CLI, 'get', 'pi_running'], env=env,
+                             stdout=subprocess.PIPE).stdout
+        if out.strip() == b'1':
+            break
+        time.sleep(0.1)
+    subprocess.run([CLI, 'set', 'pi_running', '0'], env=env,
+                   stdout=subprocess.DEVNULL)
+    daemon.send_signal(signal.SIGUSR1)
+    try:
+        log = daemon.communicate(timeout=30)[0].decode()
+    except subprocess.TimeoutExpired:
+        daemon.kill()
+        log = daemon.communicate()[0].decode() + '\n(daemon timed out)'
+    curl = None
+    if os.path.exists(curl_log):
+        with open(curl_log) as f:
+            curl = f.read().strip()
+    return log, curl
+
+
+def check_request(request, port):
+    """Check the request the daemon sent to the supervisor"""
+    head, _, body = request.partition(b'\r\n\r\n')
+    lines = head.decode(errors='replace').split('\r\n')
+    errors = []
+    expect = 'POST /v1/shutdown?apikey=%s HTTP/1.1' % API_KEY
+    if lines[0] != expect:
+        errors.append('request line %r, expected %r' % (lines[0], expect))
+    headers = {}
+    for line in lines[1:]:
+        name, _, value = line.partition(':')
+        headers[name.strip().lower()] = value.strip()
+    if headers.get('host') != '127.0.0.1:%d' % port:
+        errors.append('Host header %r' % headers.get('host'))
+    if headers.get('content-length') != '0':
+        errors.append('Content-Length header %r' %
+                      headers.get('content-length'))
+    if body:
+        errors.append('unexpected body %r' % body)
+    return errors
+
+
+def main():
+    for f in (DAEMON, CLI, EMU):
+        if not os.path.exists(f):
+            print('ERROR: %s missing, run "make check"' % f)
+            return 1
+
+    failures = 0
+    with tempfile.TemporaryDirectory() as work:
+        os.mkdir(os.path.join(work, 'hooks'))
+        # Stand-in curl that records how it was run
+        os.mkdir(os.path.join(work, 'bin'))
+        curl = os.path.join(work, 'bin', 'curl')
+        with open(curl, 'w') as f:
+            f.write('#!/bin/sh\necho "$@" > "%s"\n' %
+                    os.path.join(work, 'curl.log'))
+        os.chmod(curl, 0o755)
+
+        # Behavior, expected log message, whether curl must be run
+        cases = [
+            ('HTTP/1.1 202 Accepted',
+             'Shutdown requested from Balena supervisor', False),
+            ('HTTP/1.1 401 Unauthorized',
+             'Balena supervisor refused shutdown: status 401', True),
+            ('HTTP/1.1 500 Internal Server Error',
+             'Balena supervisor refused shutdown: status 500', True),
+            ('close', 'Balena supervisor request failed', True),
+            ('hang', 'Balena supervisor request failed: Connection timed out',
+             True),
+            ('absent', 'Balena supervisor request failed: Connection refused',
+             True),
+        ]
+        for behavior, message, fallback in cases:
+            if behavior == 'absent':
+                # Find a port nobody listens on
+                s = socket.socket()
+                s.bind(('127.0.0.1', 0))
+                port = s.getsockname()[1]
+                s.close()
+                supervisor = None
+            else:
+                supervisor = Supervisor(behavior)
+                port = supervisor.port
+            address = 'http://127.0.0.1:%d' % port
+            log, curl_args = run_daemon(work, address)
+            errors = []
+            if supervisor:
+                supervisor.join(15)
+                supervisor.close()
+                errors += check_request(supervisor.request, port)
+            if message not in log:
+                errors.append('no "%s" in log' % message)
+            if fallback and not curl_args:
+                errors.append('curl fallback not run')
+            elif fallback and ('%s/v1/shutdown?apikey=%s' %
+                               (address, API_KEY)) not in curl_args:
+                errors.append('curl run with %r' % curl_args)
+            elif not fallback and curl_args:
+                errors.append('curl run although the supervisor accepted')
+            print('%-5s %s' % ('FAIL' if errors else 'ok', behavior))
+            for e in errors:
+                print('      ' + e)
+            if errors:
+                print('      daemon log:\n        ' +
+                      log.strip().replace('\n', '\n        '))
+                failures += 1
+
+    print('%d of %d supervisor tests failed' % (failures, len(cases))
+          if failures else 'PASS')
+    return 1 if failures else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())